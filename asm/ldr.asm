@@ -29,9 +29,12 @@ extern ldr_isr_rm_callback
 
 extern pmode_stack
 extern rmode_stack
+extern __bss_start
+extern __bss_end
 
 global ldr_entrypoint
 global ldr_bios_call
+global ldr_bios_call_batch
 global ldr_jmp_to_rmode
 
 ; *****************************************************************************
@@ -48,6 +51,7 @@ struc rmode_ctx
     .efl                resd 1
     .es                 resw 1
     .ds                 resw 1
+    .dap                resb 24     ; dap_t, see shared.h
 endstruc
 
 ; *****************************************************************************
@@ -134,6 +138,15 @@ ldr_pmode32:
     mov     ss, ax
     mov     esp, pmode_stack
 
+    ; Nothing loads the .bss, it holds whatever the VBR and the BIOS left 
+    ; there: zero it before any C code reads its statics (EDX = boot drive)
+    cld
+    xor     eax, eax
+    mov     edi, __bss_start
+    mov     ecx, __bss_end
+    sub     ecx, edi
+    rep     stosb
+
     ; Enable SSE (OSFXSR = 1)
     mov     eax, cr4
     or      eax, 200h
@@ -284,6 +297,182 @@ ldr_bios_call:
 
 ;*******************************************************************************
 
+;
+; __cdecl ldr_bios_call_batch(int n, rmode_ctx* inout, int count)
+;
+; Same as ldr_bios_call for an array of contexts, the interrupts are issued
+; one after the other in a single trip to real mode
+;
+ldr_bios_call_batch:
+
+    push    ebp
+    mov     ebp, esp
+
+    ; [esp + 16]    = count
+    ; [esp + 12]    = inout
+    ; [esp + 8]     = n
+    ; [esp + 4]     = return address
+    ; [esp + 0]     = ebp
+    lea     ebp, [ebp + 8]
+
+    ; Save GPRs and EFLAGS
+    pushad
+    pushfd
+
+    ; Nothing to do for an empty array, the count is decremented to 0 below
+    mov     edx, [ebp + 8]
+    test    edx, edx
+    jle     .return
+
+    ; Setup the BIOS interrupt
+    mov     eax, [ebp]
+    mov     ebp, [ebp + 4]
+    mov     byte [.rmode_int + 0], 0CDh     ; INT XX
+    mov     byte [.rmode_int + 1], al       ;
+    mov     byte [.rmode_int + 2], 090h     ; NOP
+
+    ; Save and set the stack (in the first context)
+    mov     [ebp + rmode_ctx.esp], esp
+
+    ; Setup the segment selectors and jump to 16-bit protected mode
+    mov     ax, ldr_gdt.pmode16_dseg
+    mov     ds, ax
+    mov     es, ax
+    mov     ss, ax
+    mov     fs, ax
+    mov     gs, ax
+
+    ; Protected mode 16 bit jump
+    jmp     ldr_gdt.pmode16_cseg : dword .pmode16
+
+[BITS 16]
+
+.pmode16:
+
+    ; Disable protected mode (PE = 0)
+    mov     eax, cr0
+    and     eax, 0FFFFFFFEh
+    mov     cr0, eax
+
+    ; Jump to real mode
+    push    word 0      ; cs
+    push    word .rmode ; offset
+    retf
+
+.rmode:
+
+    xor     ax, ax
+    mov     fs, ax
+    mov     gs, ax
+
+    ; The first context as seg:offs too, see below
+    mov     eax, ebp
+    mov     ebx, eax
+    shr     eax, 4
+    mov     ds, ax
+    and     bx, 0Fh
+
+    mov     eax, [ds:bx + rmode_ctx.esp]
+    mov     ebx, eax
+    shr     eax, 4
+    and     eax, 0F000h
+    mov     ss, ax
+    movzx   esp, bx
+
+    ; Enable interrupts
+    sti
+
+    ; First context (for the way back), count and current context
+    push    ebp
+    push    edx
+    push    ebp
+
+.rmode_next:
+
+    ; Address the context as seg:offs with offs < 16, the array can cross
+    ; a 64 KB boundary (BP-relative operands default to SS, hence ds:)
+    mov     eax, [esp]
+    mov     ebx, eax
+    shr     eax, 4
+    mov     ds, ax
+    and     bx, 0Fh
+    mov     bp, bx
+
+    mov     ax, [ds:bp + rmode_ctx.es]
+    mov     es, ax
+
+    mov     eax, [ds:bp + rmode_ctx.eax]
+    mov     ecx, [ds:bp + rmode_ctx.ecx]
+    mov     edx, [ds:bp + rmode_ctx.edx]
+    mov     ebx, [ds:bp + rmode_ctx.ebx]
+    mov     esi, [ds:bp + rmode_ctx.esi]
+    mov     edi, [ds:bp + rmode_ctx.edi]
+    push    ebp
+    push    ebp
+
+.rmode_int:
+
+    int     0FFh
+    nop
+
+    mov     [esp + 4], ebp
+    pop     ebp
+    pushfd
+    pop     dword [ds:bp + rmode_ctx.efl]
+    pop     dword [ds:bp + rmode_ctx.ebp]
+    mov     [ds:bp + rmode_ctx.eax], eax
+    mov     [ds:bp + rmode_ctx.ecx], ecx
+    mov     [ds:bp + rmode_ctx.edx], edx
+    mov     [ds:bp + rmode_ctx.ebx], ebx
+    mov     [ds:bp + rmode_ctx.esi], esi
+    mov     [ds:bp + rmode_ctx.edi], edi
+
+    ; Next context, if any
+    pop     eax
+    pop     edx
+    add     eax, rmode_ctx_size
+    dec     edx
+    jz      .rmode_done
+    push    edx
+    push    eax
+    jmp     .rmode_next
+
+.rmode_done:
+
+    ; Flat address of the first context, it holds the pmode stack
+    pop     ebp
+
+    ; Switch back to protected mode 32 bit
+    ; Disable interrupts (no IDT) and switch back to protected mode (PE = 1)
+    cli
+    mov     eax, cr0
+    or      eax, 1
+    mov     cr0, eax
+    jmp     ldr_gdt.pmode32_cseg : dword .pmode32
+
+[BITS 32]
+
+.pmode32:
+
+    mov     ax, ldr_gdt.pmode32_dseg
+    mov     fs, ax
+    mov     gs, ax
+    mov     es, ax
+    mov     ds, ax
+
+    mov     ss, ax
+    mov     esp, [ebp + rmode_ctx.esp]
+
+.return:
+
+    ; Restore GPRs and EFLAGS
+    popfd
+    popad
+    pop     ebp
+    retn
+
+;*******************************************************************************
+
 [BITS 16]
 
 ldr_to_pmode32:
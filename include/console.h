@@ -63,10 +63,27 @@
 #define SERIAL_PORT3        0x3E8 /* COM 3, ttyS2 */
 #define SERIAL_PORT4        0x2E8 /* COM 4, ttyS3 */
 
+/* video console, VESA mode (VGA text mode if there is none) */
+#define CONSOLE_VIDEO_WIDTH     800
+#define CONSOLE_VIDEO_HEIGHT    600
+#define CONSOLE_VIDEO_BPP       32
+
+#define CONSOLE_NONE            0
+#define CONSOLE_VESA            1   /* 8x16 font in the linear frame buffer */
+#define CONSOLE_VGA_TEXT        2   /* mode 03h, B8000h */
+
+#define VGA_TEXT_MEMORY         0xB8000
+#define VGA_TEXT_COLS           80
+#define VGA_TEXT_ROWS           25
+#define VGA_CRTC_INDEX          0x3D4
+#define VGA_CRTC_DATA           0x3D5
+
 /******************************************************************************/
 
 void console_init(int serial_port);
 
+void console_flush(void);
+
 char getch(void);
 
 void putch(char c, uint8_t color);
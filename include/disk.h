@@ -21,6 +21,7 @@
 #define _DISK_H_
 
 #include <types.h>
+#include <shared.h>
 
 /******************************************************************************/
 
@@ -38,6 +39,59 @@
 #define DRIVE_FLOPPY_START      0x00
 #define DRIVE_FLOPPY_END        0x7E
 
+/* sector sizes */
+#define SECTOR_SIZE_DEFAULT     512
+#define SECTOR_SIZE_CD_DVD      2048
+#define SECTOR_SIZE_MAX         4096
+
+/* 
+    firmware limits: most BIOSes cap a transfer to 127 sectors, and some fail
+    on transfers crossing a 64 KB (physical) boundary
+*/
+#define DISK_MAX_SECTORS_PER_IO 127
+
+/* staging area (low memory) for buffers not addressable in real mode */
+#define DISK_BOUNCE_BUFFER_SIZE 0x8000
+
+/* use EDD 3.0 64-bit flat addresses (where supported) instead of bouncing */
+#define DISK_USE_FLAT_ADDRESS   0
+
+/******************************************************************************/
+
+typedef struct
+{
+    bool_t      is_queried;
+    bool_t      is_valid;
+    uint32_t    bytes_per_sector; /* logical sector size (512, 4096, ...) */
+    uint64_t    total_sectors;
+    uint8_t     edd_version; /* major.minor, e.g. 30h for EDD 3.0 */
+
+} disk_params_t;
+
+#ifdef _TRACE
+
+/* 
+    request trace (make TRACE=1), disk_trace_dump() prints one line per
+    INT 13h call, after disk_io() split the request in chunks:
+
+        DT <R|W> <first sector, hex> <sector count>
+
+    lines starting with "# " name the requests that follow, anything else 
+    is ignored, so the serial log can be fed to fsreplay as is
+*/
+#define DISK_TRACE_MAX_ENTRIES  2048
+
+typedef struct
+{
+    uint32_t    sector_start;
+    uint16_t    sectors;
+    uint8_t     mode;
+    uint8_t     drive;
+
+} disk_trace_entry_t;
+
+#endif
+
 /******************************************************************************/
 
 void disk_init(int drive);
@@ -50,8 +104,22 @@ int disk_get_booting_drive(void);
 
 void disk_set_booting_drive(int drive);
 
+bool_t disk_get_params(int drive, disk_params_t* params);
+
+void disk_update_params(int drive, edd_params_t* edd_params);
+
+uint32_t disk_get_sector_size(int drive);
+
+uint32_t disk_get_cached_sector_size(int drive);
+
 bool_t disk_io(int mode, int drive_num, uint64_t sector_start, 
   int sectors_to_transfer, uint8_t* dst_buffer);
 
+#ifdef _TRACE
+
+void disk_trace_dump(int port);
+
+#endif
+
 #endif //_DISK_H_ 
 
@@ -115,4 +115,18 @@ typedef struct
 
 } __attribute__((packed)) fat_direntry_t;
 
+/* VFAT long file name entry, attrib = 0Fh */
+typedef struct
+{
+    uint8_t     order; /* sequence number, 40h = last (first stored) entry */
+    uint16_t    name_1[5]; /* UCS-2 characters 1-5 */
+    uint8_t     attrib;
+    uint8_t     type;
+    uint8_t     checksum; /* checksum of the 8.3 name */
+    uint16_t    name_2[6]; /* UCS-2 characters 6-11 */
+    uint16_t    starting_cluster; /* always 0 */
+    uint16_t    name_3[2]; /* UCS-2 characters 12-13 */
+
+} __attribute__((packed)) fat_lfn_direntry_t;
+
 #endif //_FAT16_H_ 
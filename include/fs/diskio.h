@@ -46,7 +46,14 @@ typedef enum {
 
 DSTATUS disk_initialize (void);
 DRESULT disk_readp (BYTE* buff, DWORD sector, UINT offser, UINT count);
+DRESULT disk_readm (BYTE* buff, DWORD sector, UINT count);
+DRESULT disk_getp (BYTE** data, DWORD sector);
+DRESULT disk_getm (BYTE** data, DWORD sector, UINT* count);
+DRESULT disk_prefetch (DWORD sector, UINT count);
 DRESULT disk_writep (BYTE* buff, DWORD sc);
+DRESULT disk_seekp (UINT offset);
+DRESULT disk_blankp (void);
+DRESULT disk_sync (void);
 
 #define STA_NOINIT      0x01    /* Drive not initialized */
 #define STA_NODISK      0x02    /* No medium in the drive */
@@ -41,8 +41,13 @@ typedef int             INT;
 typedef unsigned int    UINT;
 
 /* These types MUST be 32 bit */
+#ifdef __LP64__         /* 64-bit hosts (host builds of the module) */
+typedef int             LONG;
+typedef unsigned int    DWORD;
+#else
 typedef long            LONG;
 typedef unsigned long   DWORD;
+#endif
 
 #endif
 
@@ -28,6 +28,10 @@ extern "C" {
 #error Wrong configuration file (pffconf.h).
 #endif
 
+#if _MAX_SS != 512 && _MAX_SS != 1024 && _MAX_SS != 2048 && _MAX_SS != 4096
+#error Wrong sector size (_MAX_SS).
+#endif
+
 #if _FS_FAT32
 #define CLUST   DWORD
 #else
@@ -39,20 +43,50 @@ extern "C" {
 
 typedef struct {
     BYTE    fs_type;    /* FAT sub type */
-    BYTE    flag;       /* File status flags */
     BYTE    csize;      /* Number of sectors per cluster */
-    BYTE    pad1;
+#if _USE_WRITE
+    BYTE    n_fats;     /* Number of FAT copies */
+    BYTE    fsi_flag;   /* FSInfo needs to be written back */
+#endif
     WORD    n_rootdir;  /* Number of root directory entries (0 on FAT32) */
+#if _MAX_SS != 512
+    WORD    ssize;      /* Bytes per sector (512, 1024, 2048 or 4096) */
+#endif
     CLUST   n_fatent;   /* Number of FAT entries (= number of clusters + 2) */
     DWORD   fatbase;    /* FAT start sector */
     DWORD   dirbase;    /* Root directory start sector (Cluster# on FAT32) */
     DWORD   database;   /* Data start sector */
+#if _USE_WRITE
+    DWORD   fsize;      /* Sectors per FAT */
+    DWORD   fsi_sect;   /* FSInfo sector (0:Not available) */
+    CLUST   last_clust; /* Last allocated cluster, where the search for a free cluster starts */
+    DWORD   free_clust; /* Number of free clusters (0xFFFFFFFF:Unknown) */
+#endif
+} FATFS;
+
+
+
+/* File object structure */
+
+typedef struct {
+    BYTE    flag;       /* File status flags */
+#if _LSEEK_CKPTS
+    BYTE    ckshift;    /* Clusters between checkpoints (log2) */
+#endif
     DWORD   fptr;       /* File R/W pointer */
     DWORD   fsize;      /* File size */
     CLUST   org_clust;  /* File start cluster */
     CLUST   curr_clust; /* File current cluster */
     DWORD   dsect;      /* File current data sector */
-} FATFS;
+#if _LSEEK_CKPTS
+    CLUST   ckpt[_LSEEK_CKPTS]; /* First cluster of each part of the chain (0:Not known yet) */
+#endif
+#if _USE_WRITE
+    CLUST   dir_clust;  /* Start cluster of the parent directory (0:Root) */
+    DWORD   dir_sect;   /* Sector containing the directory entry */
+    WORD    dir_ofs;    /* Offset of the directory entry in the sector */
+#endif
+} FIL;
 
 
 
@@ -64,6 +98,10 @@ typedef struct {
     CLUST   sclust;     /* Table start cluster (0:Static table) */
     CLUST   clust;      /* Current cluster */
     DWORD   sect;       /* Current sector */
+#if _USE_LFN
+    char*   lfn;        /* Pointer to the path segment (find) or the LFN buffer (read) */
+    UINT    lfsize;     /* Length of the path segment or size of the LFN buffer */
+#endif
 } DIR;
 
 
@@ -76,6 +114,10 @@ typedef struct {
     WORD    ftime;      /* Last modified time */
     BYTE    fattrib;    /* Attribute */
     char    fname[13];  /* File name */
+#if _USE_LFN
+    char*   lfname;     /* Pointer to the LFN buffer (NULL:Not used) */
+    UINT    lfsize;     /* Size of the LFN buffer */
+#endif
 } FILINFO;
 
 
@@ -98,23 +140,28 @@ typedef enum {
 /* Petit FatFs module application interface                     */
 
 FRESULT pf_mount (FATFS* fs);                               /* Mount/Unmount a logical drive */
-FRESULT pf_open (const char* path);                         /* Open a file */
-FRESULT pf_read (void* buff, UINT btr, UINT* br);           /* Read data from the open file */
-FRESULT pf_write (const void* buff, UINT btw, UINT* bw);    /* Write data to the open file */
-FRESULT pf_lseek (DWORD ofs);                               /* Move file pointer of the open file */
+FRESULT pf_open (FIL* fp, const char* path);                /* Open a file */
+FRESULT pf_read (FIL* fp, void* buff, UINT btr, UINT* br);  /* Read data from the open file */
+FRESULT pf_read_stream (FIL* fp, UINT (*func)(void*, const BYTE*, UINT), void* ctx, UINT btr, UINT* br);   /* Hand data of the open file to a stream function in place */
+FRESULT pf_write (FIL* fp, const void* buff, UINT btw, UINT* bw);   /* Write data to the open file */
+FRESULT pf_sync (void);                                     /* Flush the written data to the disk */
+FRESULT pf_lseek (FIL* fp, DWORD ofs);                      /* Move file pointer of the open file */
 FRESULT pf_opendir (DIR* dj, const char* path);             /* Open a directory */
 FRESULT pf_readdir (DIR* dj, FILINFO* fno);                 /* Read a directory item from the open directory */
 
+#if _USE_DIRIDX || _USE_WRITE
+void* pf_memalloc (UINT msize);                             /* Allocate a memory block (provided by the platform) */
+#endif
+
 
 
 /*--------------------------------------------------------------*/
 /* Flags and offset address                                     */
 
-/* File status flag (FATFS.flag) */
+/* File status flag (FIL.flag) */
 
 #define FA_OPENED   0x01
 #define FA_WPRT     0x02
-#define FA__WIP     0x40
 
 
 /* FAT sub type (FATFS.fs_type) */
@@ -30,10 +30,53 @@
 #define _USE_LSEEK  1   /* Enable pf_lseek() function */
 #define _USE_WRITE  1   /* Enable pf_write() function */
 
+#define _LSEEK_CKPTS    32
+/* The _LSEEK_CKPTS specifies the number of cluster checkpoints kept for the open
+/  file (0:Disabled). The cluster chain is split in _LSEEK_CKPTS equal parts at
+/  pf_open() and the first cluster of each part is recorded as reads and seeks
+/  walk the chain, so pf_lseek() resumes from the nearest checkpoint instead of
+/  the top of the file. The checkpoints live in FIL, so each open file takes
+/  4 bytes per checkpoint.
+*/
+
+#define _USE_LFN    1   /* Enable long file names (VFAT) */
+/* With _USE_LFN, path segments are also matched against long file names
+/  (case-insensitive, ASCII only) and pf_readdir() returns the long file name
+/  in FILINFO.lfname when a buffer is given.
+*/
+
+#define _USE_DIRIDX 1   /* Enable the directory index */
+
+#define _DIRIDX_SIZE    512
+#define _DIRIDX_DIRS    8
+/* The _DIRIDX_SIZE specifies the number of entries of the directory index (a
+/  power of 2) and _DIRIDX_DIRS the number of directories it can hold. The root
+/  directory is indexed at mount time, sub-directories the first time a path
+/  goes through them. Lookups in an indexed directory need no disk access. The
+/  table is allocated with pf_memalloc(), 24 bytes per entry (32 with
+/  _USE_WRITE).
+*/
+
+#define _FREEMAP_SIZE   0x4000
+/* The _FREEMAP_SIZE specifies the size in bytes of the free cluster bitmap used
+/  by pf_write() to grow files (0:Disabled). It takes one bit per cluster plus
+/  one bit per FAT sector, and is filled lazily from large reads of the FAT,
+/  starting from the FSInfo next free hint. Volumes with more clusters than fit
+/  in it search the FAT sector by sector instead. It is allocated with
+/  pf_memalloc() at the first mount.
+*/
+
 #define _FS_FAT12   0   /* Enable FAT12 */
 #define _FS_FAT16   0   /* Enable FAT16 */
 #define _FS_FAT32   1   /* Enable FAT32 */
 
+#define _MAX_SS     4096
+/* The _MAX_SS specifies the largest sector size to be supported (512, 1024,
+/  2048 or 4096). When it is larger than 512, the sector size is read from the
+/  BPB at mount time, which allows native 4K sector (4Kn) media to be used.
+/  512e media report 512 byte logical sectors and need no special handling.
+*/
+
 
 /*---------------------------------------------------------------------------/
 / Locale and Namespace Configurations
@@ -79,7 +122,7 @@
 / System Configurations
 /---------------------------------------------------------------------------*/
 
-#define _WORD_ACCESS    0
+#define _WORD_ACCESS    1
 /* The _WORD_ACCESS option is an only platform dependent option. It defines
 /  which access method is used to the word data on the FAT volume.
 /
@@ -56,14 +56,28 @@ void __sgdt(gdt_t* dst);
 
 uint64_t __rdmsr(uint64_t msr);
 
+void __wrmsr(uint64_t msr, uint64_t value);
+
+void __wbinvd(void);
+
+uint32_t __cr0();
+
+void __set_cr0(uint32_t value);
+
 uint64_t __rflags();
 
 uint16_t __cs();
 
+void __cpuid(uint32_t leaf, uint32_t* regs);
+
 void memcpy(void* dst, void* src, size_t size);
 
+void memmove(void* dst, void* src, size_t size);
+
 void memset(void* dst, uint32_t data, size_t size);
 
+void memset32(void* dst, uint32_t data, size_t count);
+
 int memcmp(void* a, void* b, size_t n);
 
 void outportb(uint16_t port, uint8_t val);
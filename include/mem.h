@@ -30,7 +30,11 @@
     1000h to 7C00h: bootkit code
     7C00h to 7E00h: mbr/vbr
     10000h to 100000h: misc memory (compat. with real mode addressing)
+    100000h to F00000h: high memory, never freed (video buffers)
 */
+#define MEM_HIGH_BASE       0x100000
+#define MEM_HIGH_END        0xF00000
+#define MEM_HIGH_ALIGN      0x1000
 
 /******************************************************************************/
 
@@ -54,4 +58,6 @@ void* malloc(size_t size);
 
 void free(void* mem);
 
+void* mem_high_alloc(size_t size);
+
 #endif //_MEMORY_H_ 
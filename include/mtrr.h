@@ -0,0 +1,69 @@
+/*
+
+    This file is part of x86_vbrkit.
+
+    Copyright 2017 / the`janitor / < email: base64dec(dGhlLmphbml0b3JAcHJvdG9ubWFpbC5jb20=) >
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+#ifndef _MTRR_H_
+#define _MTRR_H_
+
+#include <types.h>
+
+/******************************************************************************/
+
+/*
+    Memory type range registers (Intel SDM Vol. 3A, 11.11), the loader runs
+    without paging so the PAT does not apply and a variable MTRR is the only
+    way to change the memory type of the frame buffer
+*/
+#define CPUID_FEATURE_MTRR          (1 << 12)   /* CPUID.1:EDX */
+
+#define MSR_MTRR_CAP                0xFE
+#define MSR_MTRR_DEF_TYPE           0x2FF
+#define MSR_MTRR_PHYS_BASE(n)       (0x200 + 2 * (n))
+#define MSR_MTRR_PHYS_MASK(n)       (0x201 + 2 * (n))
+
+#define MTRR_CAP_VCNT               0xFF        /* variable ranges */
+#define MTRR_CAP_WC                 (1 << 10)
+#define MTRR_DEF_TYPE_ENABLE        (1 << 11)
+#define MTRR_PHYS_MASK_VALID        (1 << 11)
+#define MTRR_PAGE_SIZE              0x1000
+
+#define MTRR_TYPE_UC                0
+#define MTRR_TYPE_WC                1
+#define MTRR_TYPE_WB                6
+
+#define CR0_NW                      (1 << 29)
+#define CR0_CD                      (1 << 30)
+
+/* variable ranges changed at most, a WC range and the split of a UC range */
+#define MTRR_MAX_CHANGES            16
+
+typedef struct
+{
+    int         index;
+    uint64_t    base;       /* IA32_MTRR_PHYSBASEn */
+    uint64_t    mask;       /* IA32_MTRR_PHYSMASKn */
+
+} mtrr_range_t;
+
+/******************************************************************************/
+
+bool_t mtrr_set_wc(uint32_t base, uint32_t size);
+
+void mtrr_restore(void);
+
+#endif //_MTRR_H_ 
@@ -33,9 +33,24 @@ typedef struct
     uint16_t    dst_offs;
     uint16_t    dst_seg;
     uint64_t    sector_start;
+    uint64_t    dst_flat; /* EDD 3.0, used if dst_seg:dst_offs = FFFF:FFFF */
 
 } __attribute__((packed)) dap_t;
 
+/* Extended drive parameters (EDD, INT 13H / AH=48H) */
+typedef struct 
+{
+    uint16_t    size;
+    uint16_t    flags;
+    uint32_t    cylinders;
+    uint32_t    heads;
+    uint32_t    sectors_per_track;
+    uint64_t    total_sectors;
+    uint16_t    bytes_per_sector;
+    uint32_t    dpte_ptr; /* v2.x and later */
+
+} __attribute__((packed)) edd_params_t;
+
 /* System memory map address range descriptor */
 typedef struct 
 {
@@ -177,6 +192,8 @@ typedef struct
 
 extern void ldr_bios_call(int n, volatile rmode_ctx_t* rmode_ctx);
 
+extern void ldr_bios_call_batch(int n, volatile rmode_ctx_t* rmode_ctx, int count);
+
 extern void ldr_jmp_to_rmode(uint32_t seg, uint32_t offs, volatile rmode_ctx_t* rmode_ctx);
 
 /******************************************************************************/
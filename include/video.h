@@ -76,6 +76,59 @@ typedef struct
 
 } __attribute__ ((packed)) vesa_mode_info_t;
 
+/* the BIOS may write the whole VBE 2.0 block (256 bytes) */
+#define VESA_MODE_INFO_SIZE 256
+#define VESA_MAX_MODES      128
+
+/* 
+    usable modes (LFB, packed pixel or direct color, 8/16/32 bpp), queried
+    once by vesa_enum_modes() and kept for the lifetime of the loader
+*/
+typedef struct
+{
+    uint16_t    mode;
+    uint16_t    width;
+    uint16_t    height;
+    uint16_t    pitch;
+    uint32_t    lfb;
+    uint8_t     bpp;
+    uint8_t     memory_model;
+    uint8_t     red_mask_size;
+    uint8_t     red_mask_pos;
+    uint8_t     green_mask_size;
+    uint8_t     green_mask_pos;
+    uint8_t     blue_mask_size;
+    uint8_t     blue_mask_pos;
+
+} vesa_mode_t;
+
+/* 
+    the active mode compiled by vesa_set_mode(), the pixels of the frame 
+    buffer (and of the bitmaps) are ((color & mask) << shift) per channel
+*/
+typedef struct
+{
+    uint8_t*    lfb;            /* NULL if there is no linear frame buffer */
+    uint32_t    pitch;          /* bytes per scanline */
+    uint32_t    width;
+    uint32_t    height;
+    uint8_t     bpp;
+    uint8_t     pixel_size;     /* bytes */
+    uint8_t     red_shift;
+    uint8_t     green_shift;
+    uint8_t     blue_shift;
+    uint8_t     red_mask;
+    uint8_t     green_mask;
+    uint8_t     blue_mask;
+    uint32_t    rgb_mask;       /* color bits of a packed pixel */
+
+    uint32_t    (*pack)(uint32_t rgb);
+    uint32_t    (*unpack)(uint32_t pixel);
+    void        (*store)(uint8_t* ptr, uint32_t pixel);
+    uint32_t    (*load)(uint8_t* ptr);
+
+} vesa_pixel_fmt_t;
+
 typedef struct
 {
     uint32_t    width;
@@ -85,6 +138,81 @@ typedef struct
 
 } bmp_t;
 
+/* 
+    glyphs of a font expanded for a pixel size, a scale and a color pair,
+    bmp_puts() copies them a row at a time 
+*/
+#define GLYPH_CACHE_SLOTS   4
+
+typedef struct
+{
+    uint8_t*    font_ptr;       /* NULL if the slot is free */
+    uint32_t    font_width;
+    uint32_t    font_height;
+    uint8_t     scale;
+    uint8_t     bpp;
+    uint32_t    fg;
+    uint32_t    bg;
+    uint32_t    glyph_size;     /* bytes of an expanded glyph */
+    uint32_t    last_use;
+    uint32_t    buffer_size;
+    uint8_t*    buffer;         /* 256 glyphs, in high memory */
+    uint8_t     loaded[32];     /* one bit per expanded glyph */
+
+} glyph_cache_t;
+
+/* dirty pixels of a back buffer row, [x0, x1) */
+typedef struct
+{
+    uint16_t    x0;
+    uint16_t    x1;     /* 0 if the row is clean */
+
+} video_span_t;
+
+/* 
+    streaming image decoder, the file is handed over in chunks and every
+    source row is converted into the target bitmap as soon as it is whole 
+*/
+#define IMG_STATE_MAGIC     0
+#define IMG_STATE_PPM       1   /* P6 header: width, height, maxval */
+#define IMG_STATE_BMP       2   /* BMP file and info headers */
+#define IMG_STATE_SKIP      3   /* up to the BMP pixel array */
+#define IMG_STATE_PIXELS    4
+#define IMG_STATE_DONE      5
+#define IMG_STATE_ERROR     6
+
+#define IMG_FORMAT_PPM      1
+#define IMG_FORMAT_BMP      2
+
+#define IMG_BMP_HEADER_SIZE 54  /* BITMAPFILEHEADER + BITMAPINFOHEADER */
+
+typedef struct
+{
+    bmp_t*      dst;
+    uint32_t    dst_x;
+    uint32_t    dst_y;
+    bool_t      fit;            /* the target takes the size of the image */
+    uint8_t     state;
+    uint8_t     format;
+    uint8_t     field;          /* PPM header field being parsed */
+    bool_t      comment;
+    bool_t      digits;         /* a PPM header number is being parsed */
+    uint8_t     pixel_size;     /* bytes of a source pixel */
+    bool_t      bottom_up;
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    maxval;
+    uint32_t    scale;          /* PPM samples to 8 bits, 16.16 */
+    uint32_t    value;
+    uint32_t    skip;
+    uint32_t    row_size;       /* bytes of a source row, with the padding */
+    uint32_t    row;            /* source rows done */
+    uint32_t    fill;           /* bytes in header or row_buffer */
+    uint8_t     header[IMG_BMP_HEADER_SIZE];
+    uint8_t*    row_buffer;     /* a row split across two chunks */
+
+} img_decoder_t;
+
 typedef struct
 {
     uint32_t    width; /* bits */
@@ -107,18 +235,36 @@ bool_t vesa_set_mem_window(int window, int position);
 
 bool_t vesa_get_mode_info(int mode);
 
+int vesa_enum_modes(void);
+
+vesa_mode_t* vesa_get_modes(void);
+
 uint16_t vesa_find_mode(int w, int h, int bpp);
 
 bool_t vesa_set_mode(int w, int h, int bpp);
 
+bool_t vesa_set_lfb_wc(void);
+
 void vesa_get_resolution(uint32_t* w, uint32_t* h);
 
+vesa_pixel_fmt_t* vesa_get_pixel_fmt(void);
+
+bmp_t* video_back_buffer_init(void);
+
+void video_mark_dirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+void video_present(void);
+
 void vesa_set_color(uint8_t* ptr, uint8_t bpp, uint8_t r, uint8_t g, uint8_t b);
 
 void vesa_get_color(uint8_t* ptr, uint8_t bpp, uint8_t* r, uint8_t* g, uint8_t* b);
 
 void vesa_set_pixel(uint32_t x, uint32_t y, uint8_t r, uint8_t g, uint8_t b);
 
+uint8_t* vesa_get_font_8x8(void);
+
+uint8_t* vesa_get_font_8x16(void);
+
 void font_init(font_t* font, uint32_t width, uint32_t height, uint8_t scale, uint8_t* ptr);
 
 void bmp_init(bmp_t* bmp, uint32_t width, uint32_t height, uint8_t bpp, uint8_t* ptr);
@@ -129,6 +275,8 @@ void bmp_set_pixel(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t rgb);
 
 void bmp_rect(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t rgb);
 
+void bmp_putc(bmp_t* bmp, font_t* font, uint32_t x, uint32_t y, uint32_t fg, uint32_t bg, char c);
+
 void bmp_puts(bmp_t* bmp, font_t* font, uint32_t x, uint32_t y, uint32_t fg, uint32_t bg, char* str);
 
 void bmp_bitblt(bmp_t* src, bmp_t* dst, uint32_t dst_x, uint32_t dst_y);
@@ -137,6 +285,14 @@ void bmp_to_framebuffer(bmp_t* bmp);
 
 void bmp_from_ppm(bmp_t* bmp, uint8_t* ppm);
 
+void img_decoder_init(img_decoder_t* dec, bmp_t* dst, uint32_t x, uint32_t y);
+
+uint32_t img_decoder_feed(img_decoder_t* dec, const uint8_t* data, uint32_t count);
+
+bool_t img_decoder_end(img_decoder_t* dec);
+
+bool_t bmp_load_image(bmp_t* bmp, uint32_t x, uint32_t y, char* path);
+
 #endif //_VIDEO_H_ 
 
 
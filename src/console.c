@@ -25,11 +25,299 @@
 #include <console.h>
 #include <serial.h>
 #include <bios.h>
+#include <mem.h>
 
 /******************************************************************************/
 
 static int console_serial_port = 0;
 
+/* 
+    video console without BIOS calls: the cells (character and color) are
+    drawn in the back buffer of a VESA mode, or written to the VGA text 
+    memory, with a cursor of our own
+*/
+static int console_backend = CONSOLE_NONE;
+
+static bmp_t* console_bmp;
+static font_t console_font;
+
+static unsigned int console_cols;
+static unsigned int console_rows;
+static unsigned int console_row;
+static unsigned int console_col;
+
+/* 
+    shadow grid, a ring of rows starting at console_origin so a scroll
+    only clears a row. The flush compares the hash of each row with the 
+    one on screen and renders the cells that differ, nothing else.
+*/
+static uint16_t* console_cells;
+static uint32_t* console_cells_hash;
+static uint8_t* console_cells_stale;    /* hash to compute again */
+static unsigned int console_origin;
+
+/* cells on screen, by screen row */
+static uint16_t* console_drawn;
+static uint32_t* console_drawn_hash;
+
+/* standard VGA colors of the FG_* / BG_* values */
+static uint32_t console_palette[16] = 
+{
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA,
+    0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF,
+    0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF
+};
+
+/******************************************************************************/
+
+static uint32_t
+console_row_hash(uint16_t* cells)
+{
+    uint32_t hash = 0x811C9DC5;
+
+    /* FNV-1a */
+    for(unsigned int i = 0; i < console_cols; i++)
+    {
+        hash = (hash ^ cells[i]) * 0x01000193;
+    }
+
+    return hash;
+}
+
+static bool_t
+console_grid_init(void)
+{
+    uint32_t cells = console_cols * console_rows;
+
+    console_cells = (uint16_t *)malloc(cells * sizeof(uint16_t));
+    console_drawn = (uint16_t *)malloc(cells * sizeof(uint16_t));
+    console_cells_hash = (uint32_t *)malloc(console_rows * sizeof(uint32_t));
+    console_drawn_hash = (uint32_t *)malloc(console_rows * sizeof(uint32_t));
+    console_cells_stale = (uint8_t *)malloc(console_rows);
+
+    if(console_cells == NULL || console_drawn == NULL || 
+        console_cells_hash == NULL || console_drawn_hash == NULL || 
+        console_cells_stale == NULL)
+    {
+        return false;
+    }
+
+    /* zeroed cells (black on black) on both sides, as on the screen */
+    uint32_t hash = console_row_hash(console_cells);
+
+    for(unsigned int i = 0; i < console_rows; i++)
+    {
+        console_cells_hash[i] = hash;
+        console_drawn_hash[i] = hash;
+    }
+
+    console_origin = 0;
+
+    return true;
+}
+
+static bool_t
+console_video_init(void)
+{
+    rmode_ctx_t ctx;
+
+    vesa_init();
+
+    if(vesa_set_mode(CONSOLE_VIDEO_WIDTH, CONSOLE_VIDEO_HEIGHT, 
+        CONSOLE_VIDEO_BPP) && (console_bmp = video_back_buffer_init()) != NULL)
+    {
+        /* the 8x16 font of the video BIOS, read once */
+        font_init(&console_font, 8, 16, 1, vesa_get_font_8x16());
+
+        console_cols = console_bmp->width / 8;
+        console_rows = console_bmp->height / 16;
+
+        if(console_grid_init())
+        {
+            console_backend = CONSOLE_VESA;
+            return true;
+        }
+    }
+
+    /* 03h: Text, 80x25, 8x16 */
+    ctx.al = 0x03;
+    ctx.ah = 0x00;
+
+    ldr_bios_call(BIOS_SVC_VIDEO, &ctx);
+
+    console_cols = VGA_TEXT_COLS;
+    console_rows = VGA_TEXT_ROWS;
+
+    if(!console_grid_init())
+    {
+        return false;
+    }
+
+    memset((void *)VGA_TEXT_MEMORY, 0, 
+        VGA_TEXT_COLS * VGA_TEXT_ROWS * sizeof(uint16_t));
+
+    console_backend = CONSOLE_VGA_TEXT;
+
+    return true;
+}
+
+static void
+console_video_draw(unsigned int row, unsigned int col, char c, uint8_t color)
+{
+    row = (console_origin + row) % console_rows;
+
+    console_cells[row * console_cols + col] = (uint8_t)c | (color << 8);
+    console_cells_stale[row] = true;
+}
+
+static void
+console_video_scroll(void)
+{
+    /* the top row becomes the bottom one, cleared */
+    unsigned int row = console_origin;
+
+    console_origin = (console_origin + 1) % console_rows;
+
+    memset(console_cells + row * console_cols, 0, 
+        console_cols * sizeof(uint16_t));
+
+    console_cells_stale[row] = true;
+}
+
+static void
+console_video_render_cell(unsigned int row, unsigned int col, uint16_t cell)
+{
+    if(console_backend == CONSOLE_VESA)
+    {
+        bmp_putc(console_bmp, &console_font, col * 8, row * 16, 
+            console_palette[(cell >> 8) & 0x0F], console_palette[cell >> 12], 
+            (char)cell);
+    }
+    else
+    {
+        ((uint16_t *)VGA_TEXT_MEMORY)[row * VGA_TEXT_COLS + col] = cell;
+    }
+}
+
+static void
+console_video_render(void)
+{
+    for(unsigned int y = 0; y < console_rows; y++)
+    {
+        unsigned int row = (console_origin + y) % console_rows;
+
+        uint16_t* cells = console_cells + row * console_cols;
+        uint16_t* drawn = console_drawn + y * console_cols;
+
+        if(console_cells_stale[row])
+        {
+            console_cells_hash[row] = console_row_hash(cells);
+            console_cells_stale[row] = false;
+        }
+
+        /* same row on screen already */
+        if(console_cells_hash[row] == console_drawn_hash[y])
+        {
+            continue;
+        }
+
+        for(unsigned int x = 0; x < console_cols; x++)
+        {
+            if(cells[x] != drawn[x])
+            {
+                console_video_render_cell(y, x, cells[x]);
+                drawn[x] = cells[x];
+            }
+        }
+
+        console_drawn_hash[y] = console_cells_hash[row];
+    }
+}
+
+static void
+console_video_putch(char c, uint8_t color)
+{
+    if(c == '\n')
+    {
+        console_col = 0;
+        console_row++;
+    }
+    else
+    if(c == '\r')
+    {
+        console_col = 0;
+    }
+    else
+    if(c == '\b')
+    {
+        if(console_col != 0)
+            console_col--;
+    }
+    else
+    if(c == '\t')
+    {
+        console_col = (console_col + 8) & ~7;
+    }
+    else
+    {
+        console_video_draw(console_row, console_col, c, color);
+        console_col++;
+    }
+
+    if(console_col >= console_cols)
+    {
+        console_col = 0;
+        console_row++;
+    }
+
+    if(console_row >= console_rows)
+    {
+        console_video_scroll();
+        console_row = console_rows - 1;
+    }
+}
+
+static void
+console_putch(char c, uint8_t color)
+{
+    if(console_serial_port == 0 && console_backend == CONSOLE_NONE)
+    {
+        rmode_ctx_t ctx;
+
+        /* no memory for the grid, write text in teletype mode */
+        if(c == '\n') 
+        {
+            console_putch('\r', color);
+        }
+
+        ctx.ah = BIOS_SVC_VIDEO_PUTCHAR;
+        ctx.al = c;
+        ctx.bh = 0x00; /* video page number */
+        ctx.bl = ((color >> 0) & 0x0F);
+
+        ldr_bios_call(BIOS_SVC_VIDEO, &ctx);
+    }
+    else
+    if(console_serial_port == 0)
+    {
+        console_video_putch(c, color);
+    }
+    else
+    {
+        serial_putch(console_serial_port, c);
+    }
+}
+
+static void
+console_puts(char* str, uint8_t color)
+{
+    while(*str != 0) 
+    {
+        console_putch(*str++, color);
+    }       
+}
+
 /******************************************************************************/
 
 void
@@ -37,7 +325,7 @@ console_init(int serial_port)
 {
     if(serial_port == 0)
     {
-        video_init();
+        console_video_init();
     }
     else
     {
@@ -47,6 +335,32 @@ console_init(int serial_port)
     console_serial_port = serial_port;
 }
 
+void
+console_flush(void)
+{
+    uint16_t position = console_row * console_cols + console_col;
+
+    if(console_backend == CONSOLE_NONE)
+    {
+        return;
+    }
+
+    console_video_render();
+
+    if(console_backend == CONSOLE_VESA)
+    {
+        video_present();
+    }
+    else
+    {
+        /* hardware cursor */
+        outportb(VGA_CRTC_INDEX, 0x0F);
+        outportb(VGA_CRTC_DATA, position & 0xFF);
+        outportb(VGA_CRTC_INDEX, 0x0E);
+        outportb(VGA_CRTC_DATA, position >> 8);
+    }
+}
+
 char 
 getch(void)
 {
@@ -70,36 +384,23 @@ getch(void)
 void
 putch(char c, uint8_t color)
 {
-    if(console_serial_port == 0)
-    {
-        rmode_ctx_t ctx;
-
-        /* write text in teletype mode */
-        if(c == '\n') 
-        {
-            putch('\r', color);
-        }
+    console_putch(c, color);
 
-        ctx.ah = BIOS_SVC_VIDEO_PUTCHAR;
-        ctx.al = c;
-        ctx.bh = 0x00; /* video page number */
-        ctx.bl = ((color >> 0) & 0x0F);
-
-        ldr_bios_call(BIOS_SVC_VIDEO, &ctx);
-    }
-    else
+    if(console_serial_port == 0)
     {
-        serial_putch(console_serial_port, c);
+        console_flush();
     }
 }
 
 void 
 puts(char* str, uint8_t color)
 {
-    while(*str != 0) 
+    console_puts(str, color);
+
+    if(console_serial_port == 0)
     {
-        putch(*str++, color);
-    }       
+        console_flush();
+    }
 }
 
 void 
@@ -107,8 +408,13 @@ putsw(wchar_t* str, uint8_t color)
 {
     while(*str != 0) 
     {
-        putch((char)*str++, color);
+        console_putch((char)*str++, color);
     }       
+
+    if(console_serial_port == 0)
+    {
+        console_flush();
+    }
 }
 
 void
@@ -116,6 +422,13 @@ get_cursor(unsigned int* row, unsigned int* col)
 {
     rmode_ctx_t ctx;
 
+    if(console_backend != CONSOLE_NONE)
+    {
+        *row = console_row;
+        *col = console_col;
+        return;
+    }
+
     ctx.ah = BIOS_SVC_VIDEO_GET_CURSOR_POS;
     ctx.bh = 0x00; /* video page number */
 
@@ -130,6 +443,15 @@ set_cursor(unsigned int row, unsigned int col)
 {
     rmode_ctx_t ctx;
 
+    if(console_backend != CONSOLE_NONE)
+    {
+        console_row = (row < console_rows) ? row : console_rows - 1;
+        console_col = (col < console_cols) ? col : console_cols - 1;
+
+        console_flush();
+        return;
+    }
+
     ctx.ah = BIOS_SVC_VIDEO_SET_CURSOR_POS;
     ctx.bh = 0x00; /* video page number */
     ctx.dh = row;
@@ -151,7 +473,7 @@ printf(uint8_t color, char* fmt, ...)
     {
         if(c != '%') 
         {
-            putch(c, color);
+            console_putch(c, color);
         } 
         else 
         {
@@ -171,14 +493,14 @@ printf(uint8_t color, char* fmt, ...)
                     int n = va_arg(args, int);
 
                     itoa(n, tmp, sizeof(tmp), ((c == 'x') ? 16 : 10));
-                    puts(tmp, color);
+                    console_puts(tmp, color);
                     break;    
                 }    
                 case 'c':
                 {
                     int n = va_arg(args, int);
 
-                    putch((n & 0xFF), color);
+                    console_putch((n & 0xFF), color);
                     break; 
                 }
                 case 's':
@@ -187,11 +509,11 @@ printf(uint8_t color, char* fmt, ...)
                     
                     if(p != 0) 
                     {
-                        puts(p, color);
+                        console_puts(p, color);
                     }  
                     else 
                     {
-                        puts("(null)", color);
+                        console_puts("(null)", color);
                     }
 
                     break;
@@ -206,14 +528,14 @@ printf(uint8_t color, char* fmt, ...)
                     }  
                     else 
                     {
-                        puts("(null)", color);
+                        console_puts("(null)", color);
                     }
 
                     break;
                 }
                 default:
                 {
-                    putch(c, color);
+                    console_putch(c, color);
                     break;
                 }
             }
@@ -221,4 +543,9 @@ printf(uint8_t color, char* fmt, ...)
     }
 
     va_end(args);
+
+    if(console_serial_port == 0)
+    {
+        console_flush();
+    }
 }
@@ -25,16 +25,254 @@
 #include <mem.h>
 #include <bios.h>
 
+#ifdef _TRACE
+#include <serial.h>
+#endif
+
 /******************************************************************************/
 
 static int boot_drive;
 
+/* bounce buffer, addressable in real mode and not crossing a 64 KB boundary */
+static uint8_t* disk_bounce_buffer;
+static uint32_t disk_bounce_buffer_size;
+
+/* cached parameters of the hard disks */
+static disk_params_t disk_params[DRIVE_HDD_END - DRIVE_HDD_START + 1];
+
+#ifdef _TRACE
+
+/* requests recorded since the last dump */
+static disk_trace_entry_t* disk_trace;
+static uint32_t disk_trace_count;
+static uint32_t disk_trace_dropped;
+
+#endif
+
+/******************************************************************************/
+
+static void
+disk_parse_params(disk_params_t* params, edd_params_t* edd_params)
+{
+    params->is_queried = true;
+    params->is_valid = true;
+    params->total_sectors = edd_params->total_sectors;
+
+    /* 
+        the sector size field is not reliable on some BIOSes (v1.x), so only
+        accept power of 2 sizes and keep the default one otherwise
+    */
+    if( edd_params->size >= 0x1A &&
+        edd_params->bytes_per_sector >= SECTOR_SIZE_DEFAULT &&
+        edd_params->bytes_per_sector <= SECTOR_SIZE_MAX &&
+        (edd_params->bytes_per_sector & (edd_params->bytes_per_sector - 1)) == 0 )
+    {
+        params->bytes_per_sector = edd_params->bytes_per_sector;
+    }
+    else
+    if(params->bytes_per_sector == 0)
+    {
+        params->bytes_per_sector = SECTOR_SIZE_DEFAULT;
+    }
+}
+
+static bool_t
+disk_query_params(int drive, disk_params_t* params)
+{
+    rmode_ctx_t ctx;
+    edd_params_t edd_params;
+
+    params->is_queried = true;
+    params->is_valid = false;
+    params->bytes_per_sector = (drive == DRIVE_CD_DVD ? 
+        SECTOR_SIZE_CD_DVD : SECTOR_SIZE_DEFAULT);
+    params->total_sectors = 0;
+    params->edd_version = 0;
+
+    /* check for EDD support and get its version */
+    ctx.ah = BIOS_SVC_DISK_INSTALL_CHECK;
+    ctx.bx = 0x55AA;
+    ctx.dl = drive;
+
+    ldr_bios_call(BIOS_SVC_DISK, &ctx);
+
+    if(!(ctx.efl & 1) && ctx.bx == 0xAA55)
+    {
+        params->edd_version = ctx.ah;
+    }
+
+    /* 
+        note: the result buffer is addressed through DS:SI, where DS is the
+        segment of the bios call context (both must live on the stack)
+    */
+    memset(&edd_params, 0, sizeof(edd_params));
+    edd_params.size = sizeof(edd_params_t);
+
+    ctx.ah = BIOS_SVC_DISK_EXTENDED_GET_PARAMS;
+    ctx.dl = drive;
+    ctx.esi = ((uint32_t)(&edd_params)) & 0xFFFF;
+
+    ldr_bios_call(BIOS_SVC_DISK, &ctx);
+
+    if(ctx.efl & 1)
+    {
+        return false;
+    }
+
+    disk_parse_params(params, &edd_params);
+
+    return true;
+}
+
+#ifdef _TRACE
+
+static void
+disk_trace_record(int mode, int drive_num, uint64_t sector_start, 
+    int sectors_to_transfer)
+{
+    if(disk_trace == NULL)
+    {
+        disk_trace = (disk_trace_entry_t *)malloc(
+            DISK_TRACE_MAX_ENTRIES * sizeof(disk_trace_entry_t));
+
+        if(disk_trace == NULL)
+        {
+            return;
+        }
+    }
+
+    if(disk_trace_count == DISK_TRACE_MAX_ENTRIES)
+    {
+        disk_trace_dropped++;
+        return;
+    }
+
+    disk_trace_entry_t* entry = &disk_trace[disk_trace_count++];
+
+    entry->sector_start = (uint32_t)sector_start;
+    entry->sectors = sectors_to_transfer;
+    entry->mode = mode;
+    entry->drive = drive_num;
+}
+
+#endif
+
+static bool_t
+disk_bounce_buffer_init(void)
+{
+    uint32_t start;
+    uint32_t end;
+    uint32_t boundary;
+
+    if(disk_bounce_buffer != NULL)
+    {
+        return true;
+    }
+
+    /* align to the largest sector size, so that 64 KB boundaries fall between sectors */
+    start = (uint32_t)malloc(DISK_BOUNCE_BUFFER_SIZE + SECTOR_SIZE_MAX);
+
+    if(start == 0)
+    {
+        return false;
+    }
+
+    start = roundup(start, SECTOR_SIZE_MAX);
+    end = start + DISK_BOUNCE_BUFFER_SIZE;
+    boundary = end & 0xFFFF0000;
+
+    /* if it crosses a 64 KB boundary, keep the largest part only */
+    if(boundary > start)
+    {
+        if(boundary - start >= end - boundary)
+        {
+            end = boundary;
+        }
+        else
+        {
+            start = boundary;
+        }
+    }
+
+    disk_bounce_buffer = (uint8_t *)start;
+    disk_bounce_buffer_size = end - start;
+
+    return true;
+}
+
+static bool_t
+disk_io_chunk(int mode, int drive_num, uint64_t sector_start, 
+    int sectors_to_transfer, uint32_t addr, bool_t use_flat_address)
+{
+    rmode_ctx_t ctx;
+
+#ifdef _TRACE
+
+    disk_trace_record(mode, drive_num, sector_start, sectors_to_transfer);
+
+#endif
+
+    /* setup disk address packet */
+    ctx.dap.reserved = 0;
+    ctx.dap.sector_start = sector_start;
+    ctx.dap.sectors_to_transfer = sectors_to_transfer;
+
+    if(use_flat_address)
+    {
+        ctx.dap.packet_size = sizeof(dap_t);
+        ctx.dap.dst_seg = 0xFFFF;
+        ctx.dap.dst_offs = 0xFFFF;
+        ctx.dap.dst_flat = addr;
+    }
+    else
+    {
+        /* normalized segment:offset, the whole chunk fits in the segment */
+        ctx.dap.packet_size = offsetof(dap_t, dst_flat);
+        ctx.dap.dst_seg = (addr >> 4) & 0xFFFF;
+        ctx.dap.dst_offs = (addr >> 0) & 0x000F;
+        ctx.dap.dst_flat = 0;
+    }
+
+    /* 
+        setup the bios call 
+        note: using LBA mode (CHS won't be supported!)
+    */
+    ctx.dl = drive_num;
+    
+    ctx.ah = (mode == READ ? 
+        BIOS_SVC_DISK_EXTENDED_READ : 
+        BIOS_SVC_DISK_EXTENDED_WRITE);
+
+    ctx.al = (mode == READ ? 0x00 : 0x00); /* write without verify */
+    ctx.esi = ((uint32_t)(&ctx.dap)) & 0xFFFF;
+
+    ldr_bios_call(BIOS_SVC_DISK, &ctx);
+
+    return (!(ctx.efl & 1) /* && ctx.ah == 0 */);
+}
+
 /******************************************************************************/
 
 void
 disk_init(int drive)
 {
+    memset(disk_params, 0, sizeof(disk_params));
+
+    /* allocated on the first transfer above 1 MB */
+    disk_bounce_buffer = NULL;
+    disk_bounce_buffer_size = 0;
+
+#ifdef _TRACE
+    /* the trace buffer is allocated on the first request */
+    disk_trace = NULL;
+    disk_trace_count = 0;
+    disk_trace_dropped = 0;
+#endif
+
     disk_set_booting_drive(drive);
+
+    /* query the geometry of the booting drive early */
+    disk_get_sector_size(drive);
 }
 
 int
@@ -49,11 +287,69 @@ disk_set_booting_drive(int drive)
     boot_drive = drive;
 }
 
+bool_t
+disk_get_params(int drive, disk_params_t* params)
+{
+    if(drive >= DRIVE_HDD_START && drive <= DRIVE_HDD_END)
+    {
+        disk_params_t* cached = &disk_params[drive - DRIVE_HDD_START];
+
+        if(!cached->is_queried)
+        {
+            disk_query_params(drive, cached);
+        }
+
+        *params = *cached;
+    }
+    else
+    {
+        disk_query_params(drive, params);
+    }
+
+    return params->is_valid;
+}
+
+void
+disk_update_params(int drive, edd_params_t* edd_params)
+{
+    if(drive >= DRIVE_HDD_START && drive <= DRIVE_HDD_END)
+    {
+        disk_parse_params(&disk_params[drive - DRIVE_HDD_START], edd_params);
+    }
+}
+
+uint32_t
+disk_get_sector_size(int drive)
+{
+    disk_params_t params;
+
+    disk_get_params(drive, &params);
+
+    return params.bytes_per_sector;
+}
+
+uint32_t
+disk_get_cached_sector_size(int drive)
+{
+    /* never queries the drive, safe to call from the INT 13h hook */
+    if(drive >= DRIVE_HDD_START && drive <= DRIVE_HDD_END)
+    {
+        disk_params_t* cached = &disk_params[drive - DRIVE_HDD_START];
+
+        if(cached->is_queried && cached->is_valid)
+        {
+            return cached->bytes_per_sector;
+        }
+    }
+
+    return SECTOR_SIZE_DEFAULT;
+}
+
 bool_t
 disk_is_valid(int drive, bool_t* is_bootable)
 {
     bool_t is_valid = false; 
-    uint8_t* buffer = (uint8_t *)malloc(512);
+    uint8_t* buffer = (uint8_t *)malloc(disk_get_sector_size(drive));
 
     if(is_bootable != NULL)
     {
@@ -131,30 +427,136 @@ bool_t
 disk_io(int mode, int drive_num, uint64_t sector_start, int sectors_to_transfer, 
     uint8_t* dst_buffer)
 {
-    rmode_ctx_t ctx;
+    disk_params_t params;
 
-    /* setup disk address packet */
-    ctx.dap.packet_size = sizeof(dap_t);
-    ctx.dap.reserved = 0;
-    ctx.dap.sector_start = sector_start;
-    ctx.dap.sectors_to_transfer = sectors_to_transfer;
-    ctx.dap.dst_seg = (((uint32_t)dst_buffer >> 4) & 0xF000);
-    ctx.dap.dst_offs = (((uint32_t)dst_buffer >> 0) & 0xFFFF);
+    uint32_t addr = (uint32_t)dst_buffer;
+
+    disk_get_params(drive_num, &params);
 
     /* 
-        setup the bios call 
-        note: using LBA mode (CHS won't be supported!)
+        split the request in chunks the firmware can handle, buffers not 
+        addressable in real mode are staged through the bounce buffer
     */
-    ctx.dl = drive_num;
-    
-    ctx.ah = (mode == READ ? 
-        BIOS_SVC_DISK_EXTENDED_READ : 
-        BIOS_SVC_DISK_EXTENDED_WRITE);
+    while(sectors_to_transfer > 0)
+    {
+        int count = sectors_to_transfer;
 
-    ctx.al = (mode == READ ? 0x00 : 0x00); /* write without verify */
-    ctx.esi = ((uint32_t)(&ctx.dap)) & 0xFFFF;
+        uint32_t io_addr = addr;
+        uint32_t size;
 
-    ldr_bios_call(BIOS_SVC_DISK, &ctx);
+        bool_t use_flat_address = false;
+        bool_t use_bounce_buffer = false;
 
-    return (!(ctx.efl & 1) /* && ctx.ah == 0 */);
+        if(count > DISK_MAX_SECTORS_PER_IO)
+        {
+            count = DISK_MAX_SECTORS_PER_IO;
+        }
+
+        size = (uint32_t)count * params.bytes_per_sector;
+
+        if(addr + size > 0x100000)
+        {
+            if(DISK_USE_FLAT_ADDRESS && params.edd_version >= 0x30)
+            {
+                use_flat_address = true;
+            }
+            else
+            {
+                use_bounce_buffer = true;
+            }
+        }
+        else
+        if((addr & 0xFFFF) + params.bytes_per_sector > 0x10000)
+        {
+            /* a single sector would cross a 64 KB boundary */
+            use_bounce_buffer = true;
+        }
+
+        if(use_bounce_buffer)
+        {
+            if(!disk_bounce_buffer_init())
+            {
+                return false;
+            }
+
+            io_addr = (uint32_t)disk_bounce_buffer;
+
+            if(size > disk_bounce_buffer_size)
+            {
+                count = disk_bounce_buffer_size / params.bytes_per_sector;
+            }
+        }
+
+        /* do not cross a 64 KB boundary */
+        if(!use_flat_address)
+        {
+            int max_count = (0x10000 - (io_addr & 0xFFFF)) / params.bytes_per_sector;
+
+            if(count > max_count)
+            {
+                count = max_count;
+            }
+        }
+
+        size = (uint32_t)count * params.bytes_per_sector;
+
+        if(use_bounce_buffer && mode == WRITE)
+        {
+            memcpy(disk_bounce_buffer, (void *)addr, size);
+        }
+
+        if(!disk_io_chunk(mode, drive_num, sector_start, count, 
+            io_addr, use_flat_address))
+        {
+            return false;
+        }
+
+        if(use_bounce_buffer && mode == READ)
+        {
+            memcpy((void *)addr, disk_bounce_buffer, size);
+        }
+
+        sector_start += count;
+        sectors_to_transfer -= count;
+        addr += size;
+    }
+
+    return true;
+}
+
+#ifdef _TRACE
+
+void
+disk_trace_dump(int port)
+{
+    char line[64];
+
+    serial_puts(port, "# loader\n");
+
+    for(uint32_t i = 0; i < disk_trace_count; i++)
+    {
+        disk_trace_entry_t* entry = &disk_trace[i];
+
+        /* sprintf appends to the buffer */
+        line[0] = 0;
+
+        sprintf(line, "DT %c %x %d\n", (entry->mode == READ ? 'R' : 'W'), 
+            entry->sector_start, entry->sectors);
+
+        serial_puts(port, line);
+    }
+
+    if(disk_trace_dropped != 0)
+    {
+        line[0] = 0;
+
+        sprintf(line, "# %d requests dropped\n", disk_trace_dropped);
+
+        serial_puts(port, line);
+    }
+
+    disk_trace_count = 0;
+    disk_trace_dropped = 0;
 }
+
+#endif
@@ -49,6 +49,40 @@ dump_hex(uint8_t* data, size_t size)
     }
 }
 
+static uint8_t
+lfn_checksum(uint8_t* name)
+{
+    uint8_t sum = 0;
+
+    for(int i = 0; i < 11; i++)
+    {
+        sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+    }
+
+    return sum;
+}
+
+static void
+lfn_copy(char* long_name, fat_lfn_direntry_t* entry)
+{
+    uint16_t chars[13];
+
+    memcpy(&chars[0], entry->name_1, sizeof(entry->name_1));
+    memcpy(&chars[5], entry->name_2, sizeof(entry->name_2));
+    memcpy(&chars[11], entry->name_3, sizeof(entry->name_3));
+
+    int offset = ((entry->order & 0x3F) - 1) * 13;
+
+    for(int i = 0; i < 13; i++)
+    {
+        if(chars[i] == 0x0000 || chars[i] == 0xFFFF)
+            break;
+
+        /* only ASCII is printed as is */
+        long_name[offset + i] = (chars[i] < 0x80) ? (char)chars[i] : '?';
+    }
+}
+
 static bool_t
 is_volume_fat16(uint8_t* bs)
 {
@@ -198,6 +232,11 @@ print_fat32_info(int fd, uint8_t* bs)
     {
         uint32_t fat_val = fat32_bs->ebpb.root_cluster;
 
+        /* long file name being assembled, up to 20 entries of 13 chars */
+        char    long_name[20 * 13 + 1];
+        int     lfn_order = 0;
+        uint8_t lfn_sum = 0;
+
         while(true)
         {
             /* base sector of cluster(fat_val) */
@@ -245,7 +284,33 @@ print_fat32_info(int fd, uint8_t* bs)
                 
                 if(entry->attrib == 0x0F)
                 {
-                    // long file name
+                    /* long file name, stored in reverse order before the 8.3 entry */
+                    fat_lfn_direntry_t* lfn_entry = (fat_lfn_direntry_t *)entry;
+
+                    int order = lfn_entry->order & 0x3F;
+
+                    if(order == 0 || order > 20)
+                    {
+                        lfn_order = 0;
+                    }
+                    else if(lfn_entry->order & 0x40)
+                    {
+                        memset(long_name, 0, sizeof(long_name));
+                        lfn_copy(long_name, lfn_entry);
+
+                        lfn_order = order;
+                        lfn_sum = lfn_entry->checksum;
+                    }
+                    else if(order == lfn_order - 1 && lfn_entry->checksum == lfn_sum)
+                    {
+                        lfn_copy(long_name, lfn_entry);
+
+                        lfn_order = order;
+                    }
+                    else
+                    {
+                        lfn_order = 0;
+                    }
                 }
                 else
                 {
@@ -254,8 +319,19 @@ print_fat32_info(int fd, uint8_t* bs)
                     memcpy(&name[8], entry->ext, 3);
                     name[11] = 0;
 
-                    printf("file: %s @ cluster: %i\n", name, 
-                        entry->starting_cluster);
+                    /* the long file name belongs to this entry? */
+                    if(lfn_order == 1 && lfn_checksum(entry->name) == lfn_sum)
+                    {
+                        printf("file: %s (%s) @ cluster: %i\n", name, long_name, 
+                            entry->starting_cluster);
+                    }
+                    else
+                    {
+                        printf("file: %s @ cluster: %i\n", name, 
+                            entry->starting_cluster);
+                    }
+
+                    lfn_order = 0;
                 }
             }
 
@@ -18,18 +18,477 @@
 /* Low level disk I/O module skeleton for Petit FatFs (C)ChaN, 2014      */
 /*-----------------------------------------------------------------------*/
 
+#include "pff.h"
 #include "diskio.h"
 #include "disk.h"
 #include "mem.h"
 #include "libc.h"
 
 
+/*-----------------------------------------------------------------------*/
+/* Sector cache with adaptive read-ahead                                 */
+/*-----------------------------------------------------------------------*/
+
+
+
+/*
+    Line 0 holds the read-ahead window of a sequential stream (file data),
+    the other lines hold small windows around random accesses (FAT and 
+    directory sectors). A miss right after the end of a cached line is 
+    considered sequential, and the window grows on each refill. No line 
+    crosses a 64 KB boundary, so a full refill is one BIOS call.
+*/
+#define CACHE_LINES             4
+#define CACHE_STREAM_LINE       0
+#define CACHE_STREAM_SIZE       0x10000 /* bytes */
+#define CACHE_LINE_SIZE         0x1000  /* bytes */
+
+#define READ_AHEAD_MIN          8       /* sectors */
+#define READ_AHEAD_MAX          DISK_MAX_SECTORS_PER_IO /* one BIOS call */
+
+typedef struct
+{
+    uint8_t*    block;      /* allocated memory, holds the buffer */
+    uint8_t*    buffer;
+    uint32_t    sector;     /* first cached sector */
+    uint32_t    count;      /* number of valid sectors */
+    uint32_t    capacity;   /* size of the buffer, in sectors */
+    uint32_t    window;     /* read-ahead window of the last refill */
+    uint32_t    stamp;      /* last access, for LRU replacement */
+
+} cache_line_t;
+
+static cache_line_t cache_lines[CACHE_LINES];
+
+static int          cache_drive;
+static uint32_t     cache_sector_size;
+static uint64_t     cache_total_sectors;
+static uint32_t     cache_stamp;
+
+/*
+    Written sectors are held in write-back slots until the slots run out or
+    disk_sync() is called, then they are written in LBA order, one call per
+    run of consecutive sectors. Reads see the pending data.
+*/
+#define WB_BUFFER_SIZE          0x4000  /* bytes */
+#define WB_SLOTS_MAX            32
+
+typedef struct
+{
+    uint32_t    sector;
+    bool_t      used;
+    bool_t      dirty;
+
+} wb_slot_t;
+
+static wb_slot_t    wb_slots[WB_SLOTS_MAX];
+static uint8_t*     wb_buffer;  /* slot data, followed by a scratch sector */
+static uint32_t     wb_count;   /* number of usable slots */
+
+static int          wb_current = -1;    /* slot of the write in progress */
+static uint32_t     wb_offset;
+static bool_t       wb_loaded;
+
+static void
+cache_free(void)
+{
+    for(int i = 0; i < CACHE_LINES; i++)
+    {
+        if(cache_lines[i].block != NULL)
+        {
+            free(cache_lines[i].block);
+        }
+    }
+
+    memset(cache_lines, 0, sizeof(cache_lines));
+
+    if(wb_buffer != NULL)
+    {
+        free(wb_buffer);
+    }
+
+    wb_buffer = NULL;
+    wb_count = 0;
+}
+
+static uint8_t*
+wb_data(int slot)
+{
+    return wb_buffer + slot * cache_sector_size;
+}
+
+static int
+wb_find(uint32_t sector)
+{
+    for(uint32_t i = 0; i < wb_count; i++)
+    {
+        if(wb_slots[i].used && wb_slots[i].sector == sector)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void
+wb_overlay(uint32_t sector, uint32_t count, uint8_t* buffer)
+{
+    /* replace the sectors just read from the disk with the pending data */
+    for(uint32_t i = 0; i < wb_count; i++)
+    {
+        if(wb_slots[i].dirty && wb_slots[i].sector >= sector && 
+            wb_slots[i].sector - sector < count)
+        {
+            memcpy(buffer + (wb_slots[i].sector - sector) * cache_sector_size, 
+                wb_data(i), cache_sector_size);
+        }
+    }
+}
+
+static void
+wb_swap(int a, int b)
+{
+    wb_slot_t slot = wb_slots[a];
+    uint8_t* scratch = wb_data(wb_count);
+
+    wb_slots[a] = wb_slots[b];
+    wb_slots[b] = slot;
+
+    memcpy(scratch, wb_data(a), cache_sector_size);
+    memcpy(wb_data(a), wb_data(b), cache_sector_size);
+    memcpy(wb_data(b), scratch, cache_sector_size);
+
+    if(wb_current == a)
+    {
+        wb_current = b;
+    }
+    else if(wb_current == b)
+    {
+        wb_current = a;
+    }
+}
+
+static bool_t
+wb_flush(void)
+{
+    uint32_t i, j;
+
+    /* sort the slots by LBA, unused slots last, so runs are contiguous */
+    for(i = 0; i < wb_count; i++)
+    {
+        uint32_t min = i;
+
+        for(j = i + 1; j < wb_count; j++)
+        {
+            if(wb_slots[j].used && (!wb_slots[min].used || 
+                wb_slots[j].sector < wb_slots[min].sector))
+            {
+                min = j;
+            }
+        }
+
+        if(min != i)
+        {
+            wb_swap(i, min);
+        }
+    }
+
+    for(i = 0; i < wb_count; i = j)
+    {
+        j = i + 1;
+
+        if(!wb_slots[i].dirty)
+        {
+            continue;
+        }
+
+        while(j < wb_count && wb_slots[j].dirty && 
+            wb_slots[j].sector == wb_slots[j - 1].sector + 1)
+        {
+            j++;
+        }
+
+        if(!disk_io(WRITE, cache_drive, wb_slots[i].sector, j - i, wb_data(i)))
+        {
+            return false;
+        }
+
+        for(uint32_t k = i; k < j; k++)
+        {
+            wb_slots[k].used = false;
+            wb_slots[k].dirty = false;
+        }
+    }
+
+    return true;
+}
+
+static uint8_t*
+cache_alloc(cache_line_t* line, uint32_t size, uint32_t align)
+{
+    /* 
+        aligned on the line size (a power of two dividing 64 KB), disk_io
+        would otherwise split the refills at a boundary inside the buffer
+    */
+    line->block = (uint8_t *)malloc(size + align - 1);
+
+    if(line->block != NULL)
+    {
+        return (uint8_t *)roundup(line->block, align);
+    }
+
+    /* not enough memory, settle for a window that may be split */
+    line->block = (uint8_t *)malloc(size);
+
+    return line->block;
+}
+
+static bool_t
+cache_init(void)
+{
+    disk_params_t params;
+
+    cache_drive = disk_get_booting_drive();
+
+    disk_get_params(cache_drive, &params);
+
+    cache_total_sectors = params.is_valid ? params.total_sectors : 0;
+
+    memset(wb_slots, 0, sizeof(wb_slots));
+    wb_current = -1;
+
+    /* buffers are already allocated for this sector size, just invalidate */
+    if(cache_sector_size == params.bytes_per_sector && 
+        cache_lines[CACHE_STREAM_LINE].buffer != NULL)
+    {
+        for(int i = 0; i < CACHE_LINES; i++)
+        {
+            cache_lines[i].count = 0;
+        }
+
+        return true;
+    }
+
+    cache_free();
+
+    cache_sector_size = params.bytes_per_sector;
+
+    for(int i = 0; i < CACHE_LINES; i++)
+    {
+        uint32_t size = (i == CACHE_STREAM_LINE ? 
+            CACHE_STREAM_SIZE : CACHE_LINE_SIZE);
+
+        uint32_t capacity = size / cache_sector_size;
+
+        if(capacity == 0)
+        {
+            capacity = 1;
+        }
+
+        if(i == CACHE_STREAM_LINE && capacity > READ_AHEAD_MAX)
+        {
+            capacity = READ_AHEAD_MAX;
+        }
+
+        cache_lines[i].buffer = cache_alloc(&cache_lines[i], 
+            capacity * cache_sector_size, size);
+        cache_lines[i].capacity = capacity;
+
+        if(cache_lines[i].buffer == NULL)
+        {
+            cache_free();
+            return false;
+        }
+    }
+
+    wb_count = WB_BUFFER_SIZE / cache_sector_size;
+
+    if(wb_count < 2)
+    {
+        wb_count = 2;
+    }
+
+    if(wb_count > WB_SLOTS_MAX)
+    {
+        wb_count = WB_SLOTS_MAX;
+    }
+
+    wb_buffer = (uint8_t *)malloc((wb_count + 1) * cache_sector_size);
+
+    if(wb_buffer == NULL)
+    {
+        cache_free();
+        return false;
+    }
+
+    return true;
+}
+
+static cache_line_t*
+cache_lookup(uint32_t sector)
+{
+    for(int i = 0; i < CACHE_LINES; i++)
+    {
+        cache_line_t* line = &cache_lines[i];
+
+        if(sector >= line->sector && sector - line->sector < line->count)
+        {
+            return line;
+        }
+    }
+
+    return NULL;
+}
+
+static bool_t
+cache_fill(cache_line_t* line, uint32_t sector, uint32_t count)
+{
+    /* do not read past the end of the disk */
+    if(cache_total_sectors != 0 && sector + count > cache_total_sectors)
+    {
+        count = (sector < cache_total_sectors) ? 
+            (uint32_t)(cache_total_sectors - sector) : 1;
+    }
+
+    line->count = 0;
+
+    if(!disk_io(READ, cache_drive, sector, count, line->buffer))
+    {
+        /* the read-ahead may have failed, retry with the sector only */
+        if(count == 1 || !disk_io(READ, cache_drive, sector, 1, line->buffer))
+        {
+            return false;
+        }
+
+        count = 1;
+    }
+
+    wb_overlay(sector, count, line->buffer);
+
+    line->sector = sector;
+    line->count = count;
+
+    return true;
+}
+
+static cache_line_t*
+cache_victim(void)
+{
+    cache_line_t* line = NULL;
+
+    /* least recently used line, the stream line is not replaced */
+    for(int i = 0; i < CACHE_LINES; i++)
+    {
+        if(i == CACHE_STREAM_LINE)
+        {
+            continue;
+        }
+
+        if(line == NULL || cache_lines[i].stamp < line->stamp)
+        {
+            line = &cache_lines[i];
+        }
+    }
+
+    return line;
+}
+
+static uint8_t*
+cache_get(uint32_t sector)
+{
+    cache_line_t* line = cache_lookup(sector);
+
+    if(line == NULL)
+    {
+        cache_line_t* prev = NULL;
+
+        uint32_t window = READ_AHEAD_MIN;
+
+        /* is it the continuation of a cached window? */
+        for(int i = 0; i < CACHE_LINES; i++)
+        {
+            if(cache_lines[i].count != 0 && 
+                cache_lines[i].sector + cache_lines[i].count == sector)
+            {
+                prev = &cache_lines[i];
+                break;
+            }
+        }
+
+        if(prev != NULL)
+        {
+            /* sequential access, grow the window and use the stream line */
+            window = prev->window << 1;
+
+            if(window > READ_AHEAD_MAX)
+            {
+                window = READ_AHEAD_MAX;
+            }
+
+            line = &cache_lines[CACHE_STREAM_LINE];
+        }
+        else
+        {
+            /* random access, replace the least recently used line */
+            line = cache_victim();
+        }
+
+        line->window = window;
+
+        if(!cache_fill(line, sector, (window < line->capacity) ? 
+            window : line->capacity))
+        {
+            return NULL;
+        }
+    }
+
+    line->stamp = ++cache_stamp;
+
+    return line->buffer + (sector - line->sector) * cache_sector_size;
+}
+
+static void
+cache_update(uint32_t sector, uint8_t* data)
+{
+    /* 
+        windows may overlap: a refill starts at the missed sector and can run
+        into sectors another line already holds, and disk_getm() and 
+        disk_prefetch() fill the stream line without looking at the other 
+        lines. Update every copy, not just the one cache_lookup() returns, 
+        or a later read through the other line sees the old data.
+    */
+    for(int i = 0; i < CACHE_LINES; i++)
+    {
+        cache_line_t* line = &cache_lines[i];
+
+        if(sector >= line->sector && sector - line->sector < line->count)
+        {
+            memcpy(line->buffer + (sector - line->sector) * cache_sector_size, 
+                data, cache_sector_size);
+        }
+    }
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Initialize Disk Drive                                                 */
 /*-----------------------------------------------------------------------*/
 
 DSTATUS disk_initialize (void)
 {
+    /* commit the pending writes of a previous mount */
+    if(wb_buffer != NULL && !wb_flush())
+    {
+        return STA_NOINIT;
+    }
+
+    if(!cache_init())
+    {
+        return STA_NOINIT;
+    }
+
     return 0;
 }
 
@@ -46,20 +505,169 @@ DRESULT disk_readp (
     UINT count      /* Byte count (bit15:destination) */
 )
 {
-    uint8_t* buffer = (uint8_t *)malloc(512);
+    uint8_t* data = cache_get(sector);
 
-    if(buffer == NULL)
+    if(data == NULL)
     {
         return RES_ERROR;
     }
 
-    if(!disk_io(READ, disk_get_booting_drive(), sector, 1, buffer))
+    if(buff != NULL)
+    {
+        memcpy(buff, data + offset, count);
+    }
+
+    return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get a Cached Sector                                                   */
+/*-----------------------------------------------------------------------*/
+
+DRESULT disk_getp (
+    BYTE** data,    /* Receives a pointer to the sector data */
+    DWORD sector    /* Sector number (LBA) */
+)
+{
+    /* the pointer is only valid until the next call to a disk function */
+    *data = cache_get(sector);
+
+    if(*data == NULL)
+    {
+        return RES_ERROR;
+    }
+
+    return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get a Run of Cached Sectors                                           */
+/*-----------------------------------------------------------------------*/
+
+DRESULT disk_getm (
+    BYTE** data,    /* Receives a pointer to the data of the first sector */
+    DWORD sector,   /* Start sector number (LBA) */
+    UINT* count     /* Number of sectors wanted, receives the number available */
+)
+{
+    cache_line_t* line = cache_lookup(sector);
+
+    /* a long run that is not cached yet is read in one go into the stream line */
+    if(line == NULL && *count >= READ_AHEAD_MIN)
+    {
+        line = &cache_lines[CACHE_STREAM_LINE];
+        line->window = (*count < line->capacity) ? *count : line->capacity;
+
+        if(!cache_fill(line, sector, line->window))
+        {
+            return RES_ERROR;
+        }
+    }
+
+    /* the pointer is only valid until the next call to a disk function */
+    *data = cache_get(sector);
+
+    if(*data == NULL)
+    {
+        return RES_ERROR;
+    }
+
+    line = cache_lookup(sector);
+
+    if(*count > line->sector + line->count - sector)
+    {
+        *count = line->sector + line->count - sector;
+    }
+
+    return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Prefetch Sectors                                                      */
+/*-----------------------------------------------------------------------*/
+
+DRESULT disk_prefetch (
+    DWORD sector,   /* Start sector number (LBA) */
+    UINT count      /* Number of sectors to load in the cache */
+)
+{
+    cache_line_t* line;
+
+    if(count < READ_AHEAD_MIN)
+    {
+        count = READ_AHEAD_MIN;
+    }
+
+    /* large windows go to the stream line */
+    line = cache_victim();
+
+    if(count > line->capacity)
+    {
+        line = &cache_lines[CACHE_STREAM_LINE];
+    }
+
+    if(count > line->capacity)
+    {
+        count = line->capacity;
+    }
+
+    line->window = READ_AHEAD_MIN;
+    line->stamp = ++cache_stamp;
+
+    if(!cache_fill(line, sector, count))
+    {
+        return RES_ERROR;
+    }
+
+    return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read Multiple Sectors                                                 */
+/*-----------------------------------------------------------------------*/
+
+DRESULT disk_readm (
+    BYTE* buff,     /* Pointer to the destination buffer */
+    DWORD sector,   /* Start sector number (LBA) */
+    UINT count      /* Number of whole sectors to read */
+)
+{
+    /* 
+        short runs go through the cache, to benefit from the read-ahead, 
+        anything else is transferred straight into the destination
+    */
+    if(count < READ_AHEAD_MIN)
+    {
+        while(count--)
+        {
+            uint8_t* data = cache_get(sector++);
+
+            if(data == NULL)
+            {
+                return RES_ERROR;
+            }
+
+            memcpy(buff, data, cache_sector_size);
+            buff += cache_sector_size;
+        }
+
+        return RES_OK;
+    }
+
+    if(!disk_io(READ, cache_drive, sector, count, buff))
     {
         return RES_ERROR;
     }
 
-    memcpy(buff, buffer + offset, count);
-    free(buffer);
+    wb_overlay(sector, count, buff);
 
     return RES_OK;
 }
@@ -75,40 +683,170 @@ DRESULT disk_writep (
     DWORD sc        /* Sector number (LBA) or Number of bytes to send */
 )
 {
-    static int sector_number;
-    static uint8_t* buffer;
-
     if(!buff) 
     {
         if(sc) 
         {
-            buffer = (uint8_t *)malloc(512);
+            /* drop a write left unfinished by an aborted pf_write */
+            if(wb_current != -1 && !wb_slots[wb_current].dirty)
+            {
+                wb_slots[wb_current].used = false;
+            }
 
-            sector_number = sc;
+            wb_current = wb_find(sc);
+            wb_offset = 0;
+            wb_loaded = (wb_current != -1);
 
-            if(buffer == NULL)
+            for(uint32_t i = 0; i < wb_count && wb_current == -1; i++)
             {
-                return RES_ERROR;
+                if(!wb_slots[i].used)
+                {
+                    wb_current = i;
+                }
+            }
+
+            if(wb_current == -1)
+            {
+                /* no free slot, commit the pending writes */
+                if(!wb_flush())
+                {
+                    return RES_ERROR;
+                }
+
+                wb_current = 0;
+            }
+
+            if(!wb_loaded)
+            {
+                wb_slots[wb_current].sector = sc;
+                wb_slots[wb_current].used = true;
+                wb_slots[wb_current].dirty = false;
             }
 
             return RES_OK;
         } 
         else 
         {
-            free(buffer);
+            if(wb_current == -1)
+            {
+                return RES_OK;
+            }
+
+            if(wb_loaded)
+            {
+                wb_slots[wb_current].dirty = true;
+
+                /* keep the read cache coherent */
+                cache_update(wb_slots[wb_current].sector, wb_data(wb_current));
+            }
+            else
+            {
+                wb_slots[wb_current].used = false;
+            }
+
+            wb_current = -1;
         }
     } 
     else 
     {
-        memset(buffer, 0, 512);
-        memcpy(buffer, buff, sc);
+        if(wb_current == -1 || wb_offset + sc > cache_sector_size)
+        {
+            return RES_PARERR;
+        }
 
-        if(!disk_io(WRITE, disk_get_booting_drive(), sector_number, 1, buffer))
+        /* partial write, the rest of the sector keeps its contents */
+        if(!wb_loaded && (wb_offset != 0 || sc != cache_sector_size))
         {
-            return RES_ERROR;
+            uint8_t* data = cache_get(wb_slots[wb_current].sector);
+
+            if(data == NULL)
+            {
+                return RES_ERROR;
+            }
+
+            memcpy(wb_data(wb_current), data, cache_sector_size);
         }
+
+        wb_loaded = true;
+
+        memcpy(wb_data(wb_current) + wb_offset, buff, sc);
+        wb_offset += sc;
     }
 
     return RES_OK;
 }
 
+
+
+/*-----------------------------------------------------------------------*/
+/* Move the Write Position in the Sector                                 */
+/*-----------------------------------------------------------------------*/
+
+DRESULT disk_seekp (
+    UINT offset     /* Byte offset of the next data in the sector being written */
+)
+{
+    if(wb_current == -1 || offset > cache_sector_size)
+    {
+        return RES_PARERR;
+    }
+
+    wb_offset = offset;
+
+    return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Start the Sector Being Written from Zeros                             */
+/*-----------------------------------------------------------------------*/
+
+DRESULT disk_blankp (void)
+{
+    if(wb_current == -1)
+    {
+        return RES_PARERR;
+    }
+
+    /* 
+        the old contents are not needed (past the end of a file), 
+        so a partial write does not have to read the sector first
+    */
+    if(!wb_loaded)
+    {
+        memset(wb_data(wb_current), 0, cache_sector_size);
+        wb_loaded = true;
+    }
+
+    return RES_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Allocate Memory for the File System Module                            */
+/*-----------------------------------------------------------------------*/
+
+void* pf_memalloc (
+    UINT msize      /* Size of the memory block */
+)
+{
+    return malloc(msize);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Commit Pending Writes                                                 */
+/*-----------------------------------------------------------------------*/
+
+DRESULT disk_sync (void)
+{
+    if(wb_buffer != NULL && !wb_flush())
+    {
+        return RES_ERROR;
+    }
+
+    return RES_OK;
+}
@@ -55,7 +55,16 @@
 #define _FS_32ONLY 0
 #endif
 
-#define ABORT(err)  {fs->flag = 0; return err;}
+#define ABORT(err)  {fp->flag = 0; return err;}
+
+#define MOUNT_WINDOW    64  /* Sectors read along with the VBR (FSInfo, reserved area, first FAT sectors) */
+#define MAP_WINDOW      64  /* FAT sectors read at once to fill the free cluster bitmap */
+
+#if _MAX_SS == 512
+#define SS(fs)      512U            /* Fixed sector size */
+#else
+#define SS(fs)      ((UINT)(fs)->ssize) /* Variable sector size (read from the BPB) */
+#endif
 
 
 
@@ -309,6 +318,17 @@
 #define DIR_WrtDate         24
 #define DIR_FstClusLO       26
 #define DIR_FileSize        28
+#define FSI_LeadSig         0
+#define FSI_StrucSig        484
+#define FSI_Free_Count      488
+#define FSI_Nxt_Free        492
+#define LDIR_Ord            0
+#define LDIR_Chksum         13
+
+#define LLEF                0x40    /* Last long entry flag in LDIR_Ord */
+
+#define NS_LAST             0x01    /* Last segment of the path (in fn[11]) */
+#define NS_LOSS             0x02    /* The segment is not an 8.3 name (in fn[11]) */
 
 
 
@@ -323,6 +343,56 @@ static
 FATFS *FatFs;   /* Pointer to the file system object (logical drive) */
 
 
+#if _USE_DIRIDX
+#if _DIRIDX_SIZE & (_DIRIDX_SIZE - 1)
+#error Wrong directory index size (_DIRIDX_SIZE).
+#endif
+
+typedef struct {
+    CLUST   dclust;     /* Start cluster of the parent directory (0:Root) */
+    BYTE    name[11];   /* SFN (name[0] == 0:Empty slot) */
+    BYTE    attr;       /* Attribute */
+    CLUST   sclust;     /* Start cluster of the object */
+    DWORD   fsize;      /* File size */
+#if _USE_WRITE
+    DWORD   dsect;      /* Sector containing the directory entry */
+    WORD    dindex;     /* Index of the directory entry */
+#endif
+} IDXENT;
+
+static
+IDXENT *DirIdx = 0;     /* Directory index (open addressed hash table), allocated by the first mount */
+
+static
+CLUST IdxDirs[_DIRIDX_DIRS];    /* Indexed directories */
+
+static
+UINT IdxNdirs, IdxNents;
+
+static
+BYTE IdxFull;           /* No more directories can be indexed */
+#endif
+
+#if _USE_WRITE && _FREEMAP_SIZE
+static
+BYTE *MapBuf = 0;       /* Memory block of the free cluster bitmap, allocated by the first mount */
+
+static
+BYTE *FreeMap;          /* Free cluster bitmap (1:In use), NULL:Not used on this volume */
+
+static
+BYTE *FreeMapLd;        /* FAT sectors already folded in the bitmap */
+#endif
+
+
+/* Copy memory to memory */
+static
+void mem_cpy (void* dst, const void* src, int cnt) {
+    char *d = (char*)dst;
+    const char *s = (const char *)src;
+    while (cnt--) *d++ = *s++;
+}
+
 /* Fill memory */
 static
 void mem_set (void* dst, int val, int cnt) {
@@ -362,11 +432,11 @@ CLUST get_fat ( /* 1:IO error, Else:Cluster status */
         UINT wc, bc, ofs;
 
         bc = (UINT)clst; bc += bc / 2;
-        ofs = bc % 512; bc /= 512;
-        if (ofs != 511) {
+        ofs = bc % SS(fs); bc /= SS(fs);
+        if (ofs != SS(fs) - 1) {
             if (disk_readp(buf, fs->fatbase + bc, ofs, 2)) break;
         } else {
-            if (disk_readp(buf, fs->fatbase + bc, 511, 1)) break;
+            if (disk_readp(buf, fs->fatbase + bc, SS(fs) - 1, 1)) break;
             if (disk_readp(buf+1, fs->fatbase + bc + 1, 0, 1)) break;
         }
         wc = LD_WORD(buf);
@@ -375,12 +445,12 @@ CLUST get_fat ( /* 1:IO error, Else:Cluster status */
 #endif
 #if _FS_FAT16
     case FS_FAT16 :
-        if (disk_readp(buf, fs->fatbase + clst / 256, ((UINT)clst % 256) * 2, 2)) break;
+        if (disk_readp(buf, fs->fatbase + clst / (SS(fs) / 2), ((UINT)clst % (SS(fs) / 2)) * 2, 2)) break;
         return LD_WORD(buf);
 #endif
 #if _FS_FAT32
     case FS_FAT32 :
-        if (disk_readp(buf, fs->fatbase + clst / 128, ((UINT)clst % 128) * 4, 4)) break;
+        if (disk_readp(buf, fs->fatbase + clst / (SS(fs) / 4), ((UINT)clst % (SS(fs) / 4)) * 4, 4)) break;
         return LD_DWORD(buf) & 0x0FFFFFFF;
 #endif
     }
@@ -391,6 +461,245 @@ CLUST get_fat ( /* 1:IO error, Else:Cluster status */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Write data to a sector through the write-back buffer                  */
+/*-----------------------------------------------------------------------*/
+#if _USE_WRITE
+static
+FRESULT put_sect (
+    DWORD sect,         /* Sector number */
+    UINT ofs,           /* Byte offset in the sector */
+    const BYTE *dat,    /* Data to write */
+    UINT cnt            /* Number of bytes to write */
+)
+{
+    if (disk_writep(0, sect) || disk_seekp(ofs) || disk_writep((BYTE *)dat, cnt) || disk_writep(0, 0))
+        return FR_DISK_ERR;
+
+    return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Change value of a FAT entry                              */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT put_fat (
+    CLUST clst,     /* Cluster# to be changed */
+    CLUST val       /* New value to mark the cluster */
+)
+{
+    BYTE buf[4];
+    UINT ofs, n;
+    DWORD sect;
+    FATFS *fs = FatFs;
+
+
+    if (clst < 2 || clst >= fs->n_fatent)   /* Range check */
+        return FR_DISK_ERR;
+
+    /* The FAT sectors stay in the write-back buffer, so the updates of a chain are
+       coalesced and both FAT copies are written in sorted runs at pf_sync() */
+    for (n = 0; n < fs->n_fats; n++) {
+        switch (fs->fs_type) {
+#if _FS_FAT12
+        case FS_FAT12 : {
+            UINT bc = (UINT)clst; bc += bc / 2;
+
+            sect = fs->fatbase + n * fs->fsize + bc / SS(fs); ofs = bc % SS(fs);
+            if (disk_readp(buf, sect, ofs, 1)) return FR_DISK_ERR;
+            buf[0] = (clst & 1) ? ((buf[0] & 0x0F) | ((BYTE)val << 4)) : (BYTE)val;
+            if (put_sect(sect, ofs, buf, 1)) return FR_DISK_ERR;
+            bc++;                           /* The entry may straddle two sectors */
+            sect = fs->fatbase + n * fs->fsize + bc / SS(fs); ofs = bc % SS(fs);
+            if (disk_readp(buf, sect, ofs, 1)) return FR_DISK_ERR;
+            buf[0] = (clst & 1) ? (BYTE)(val >> 4) : ((buf[0] & 0xF0) | ((BYTE)(val >> 8) & 0x0F));
+            if (put_sect(sect, ofs, buf, 1)) return FR_DISK_ERR;
+            break;
+        }
+#endif
+#if _FS_FAT16
+        case FS_FAT16 :
+            sect = fs->fatbase + n * fs->fsize + clst / (SS(fs) / 2);
+            ofs = ((UINT)clst % (SS(fs) / 2)) * 2;
+            ST_WORD(buf, val);
+            if (put_sect(sect, ofs, buf, 2)) return FR_DISK_ERR;
+            break;
+#endif
+#if _FS_FAT32
+        case FS_FAT32 :
+            sect = fs->fatbase + n * fs->fsize + clst / (SS(fs) / 4);
+            ofs = ((UINT)clst % (SS(fs) / 4)) * 4;
+            if (disk_readp(buf, sect, ofs, 4)) return FR_DISK_ERR;   /* Keep the upper 4 bits */
+            ST_DWORD(buf, (LD_DWORD(buf) & 0xF0000000) | (val & 0x0FFFFFFF));
+            if (put_sect(sect, ofs, buf, 4)) return FR_DISK_ERR;
+            break;
+#endif
+        default :
+            return FR_DISK_ERR;
+        }
+    }
+
+#if _FREEMAP_SIZE
+    if (FreeMap) {                          /* Keep the bitmap in sync */
+        if (val)
+            FreeMap[clst / 8] |= 1 << (clst % 8);
+        else
+            FreeMap[clst / 8] &= ~(1 << (clst % 8));
+    }
+#endif
+
+    return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Free cluster bitmap - Fold a run of FAT sectors into the bitmap       */
+/*-----------------------------------------------------------------------*/
+#if _FREEMAP_SIZE
+static
+FRESULT map_load (
+    DWORD k,        /* First FAT sector to fold (index in the FAT) */
+    UINT epc        /* FAT entries per sector */
+)
+{
+    BYTE *sec;
+    CLUST clst, val;
+    DWORD end;
+    UINT i, n;
+    FATFS *fs = FatFs;
+
+
+    end = (fs->n_fatent + epc - 1) / epc;   /* Number of FAT sectors in use */
+    n = MAP_WINDOW;
+    if (n > end - k) n = (UINT)(end - k);
+    disk_prefetch(fs->fatbase + k, n);      /* One large read (errors show up below) */
+
+    for ( ; n; n--, k++) {
+        if (FreeMapLd[k / 8] & (1 << (k % 8))) continue;   /* Already folded */
+        if (disk_getp(&sec, fs->fatbase + k)) return FR_DISK_ERR;
+        clst = (CLUST)(k * epc);
+        for (i = 0; i < epc && clst < fs->n_fatent; i++, clst++) {
+            val = (_FS_32ONLY || fs->fs_type == FS_FAT32) ?
+                (CLUST)(LD_DWORD(sec + i * 4) & 0x0FFFFFFF) : (CLUST)LD_WORD(sec + i * 2);
+            if (val)
+                FreeMap[clst / 8] |= 1 << (clst % 8);
+            else
+                FreeMap[clst / 8] &= ~(1 << (clst % 8));
+        }
+        FreeMapLd[k / 8] |= 1 << (k % 8);
+    }
+
+    return FR_OK;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Find a free cluster                                      */
+/*-----------------------------------------------------------------------*/
+
+static
+CLUST find_free (   /* 0:No free cluster, 1:Error, >=2:Free cluster# */
+    CLUST scl       /* The search starts after this cluster */
+)
+{
+    CLUST ncl, val;
+    DWORD n;
+#if _FREEMAP_SIZE
+    UINT epc;
+#endif
+    FATFS *fs = FatFs;
+
+
+#if _FREEMAP_SIZE
+    epc = (_FS_32ONLY || fs->fs_type == FS_FAT32) ? SS(fs) / 4 : SS(fs) / 2;
+#endif
+    ncl = scl;
+    for (n = fs->n_fatent - 2; n; n--) {    /* Check each cluster once */
+        if (++ncl >= fs->n_fatent) ncl = 2;
+#if _FREEMAP_SIZE
+        if (FreeMap) {
+            if (!(FreeMapLd[ncl / epc / 8] & (1 << (ncl / epc % 8))) &&  /* Fold the FAT on first use */
+                map_load(ncl / epc, epc))
+                return 1;
+            if (!(ncl % 8) && n > 8 && FreeMap[ncl / 8] == 0xFF) {  /* Skip eight clusters in use at once */
+                ncl += 7; n -= 7;
+                continue;
+            }
+            if (!(FreeMap[ncl / 8] & (1 << (ncl % 8)))) return ncl;
+            continue;
+        }
+#endif
+        val = get_fat(ncl);
+        if (val == 1) return 1;
+        if (val == 0) return ncl;
+    }
+
+    return 0;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT access - Stretch or create a cluster chain                        */
+/*-----------------------------------------------------------------------*/
+
+static
+CLUST create_chain (    /* 0:No free cluster, 1:Error, >=2:New cluster# */
+    CLUST clst          /* Cluster# to stretch (0:Create a new chain) */
+)
+{
+    CLUST scl, ncl;
+    FATFS *fs = FatFs;
+
+
+    scl = clst ? clst : fs->last_clust;     /* Try the next cluster first to keep the file contiguous */
+    if (scl < 2 || scl >= fs->n_fatent) scl = 1;
+    ncl = find_free(scl);
+    if (ncl <= 1) return ncl;
+
+    if (put_fat(ncl, 0x0FFFFFFF)) return 1;     /* Mark the new cluster as the end of the chain */
+    if (clst && put_fat(clst, ncl)) return 1;   /* Link it to the chain */
+
+    fs->last_clust = ncl;                   /* Update the FSInfo */
+    if (fs->free_clust <= fs->n_fatent - 2) fs->free_clust--;
+    fs->fsi_flag = 1;
+
+    return ncl;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Record a cluster checkpoint of the open file                          */
+/*-----------------------------------------------------------------------*/
+#if _LSEEK_CKPTS
+static
+void set_ckpt (
+    FIL *fp,        /* Pointer to the file object */
+    DWORD n,        /* Cluster index in the file */
+    CLUST clst      /* Cluster# */
+)
+{
+    if (!(n & ((1UL << fp->ckshift) - 1)) && (n >> fp->ckshift) < _LSEEK_CKPTS)
+        fp->ckpt[n >> fp->ckshift] = clst;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Get sector# from cluster# / Get cluster field from directory entry    */
 /*-----------------------------------------------------------------------*/
@@ -474,7 +783,7 @@ FRESULT dir_next (  /* FR_OK:Succeeded, FR_NO_FILE:End of table */
     if (!i || !dj->sect)    /* Report EOT when index has reached 65535 */
         return FR_NO_FILE;
 
-    if (!(i % 16)) {        /* Sector changed? */
+    if (!(i % (SS(fs) / 32))) { /* Sector changed? */
         dj->sect++;         /* Next sector */
 
         if (dj->clust == 0) {   /* Static table */
@@ -482,7 +791,7 @@ FRESULT dir_next (  /* FR_OK:Succeeded, FR_NO_FILE:End of table */
                 return FR_NO_FILE;
         }
         else {                  /* Dynamic table */
-            if (((i / 16) & (fs->csize - 1)) == 0) {    /* Cluster changed? */
+            if (((i / (SS(fs) / 32)) & (fs->csize - 1)) == 0) { /* Cluster changed? */
                 clst = get_fat(dj->clust);      /* Get next cluster */
                 if (clst <= 1) return FR_DISK_ERR;
                 if (clst >= fs->n_fatent)       /* When it reached end of dynamic table */
@@ -505,6 +814,87 @@ FRESULT dir_next (  /* FR_OK:Succeeded, FR_NO_FILE:End of table */
 /* Directory handling - Find an object in the directory                  */
 /*-----------------------------------------------------------------------*/
 
+static
+int name_cmp (          /* 1:Names match, 0:Names differ */
+    const BYTE *dir,    /* Pointer to the directory entry */
+    const BYTE *fn      /* Pointer to the SFN */
+)
+{
+    return LD_DWORD(dir) == LD_DWORD(fn) && LD_DWORD(dir+4) == LD_DWORD(fn+4) &&
+        LD_WORD(dir+8) == LD_WORD(fn+8) && dir[10] == fn[10];
+}
+
+
+#if _USE_LFN
+static
+const BYTE LfnOfs[] = {1,3,5,7,9,14,16,18,20,22,24,28,30};  /* Offset of the characters in an LFN entry */
+
+
+static
+BYTE sum_sfn (          /* Checksum of the SFN an LFN belongs to */
+    const BYTE *dir     /* Pointer to the SFN entry */
+)
+{
+    BYTE sum = 0, n = 11;
+
+
+    do sum = (sum >> 1) + (sum << 7) + *dir++; while (--n);
+    return sum;
+}
+
+
+static
+int cmp_lfn (           /* 1:The fragment matches, 0:It differs */
+    const char *seg,    /* Pointer to the path segment */
+    UINT len,           /* Length of the path segment */
+    const BYTE *ent     /* Pointer to the LFN entry */
+)
+{
+    UINT i, pos;
+    WCHAR wc, c;
+
+
+    pos = ((ent[LDIR_Ord] & 0x3F) - 1) * 13;   /* Position of the fragment in the name */
+    for (i = 0; i < 13; i++, pos++) {
+        wc = LD_WORD(ent+LfnOfs[i]);
+        if (pos >= len) return (pos == len && wc == 0);     /* The name must end with the segment */
+        c = (BYTE)seg[pos];
+        if (IsLower(wc)) wc -= 0x20;    /* Case-insensitive (ASCII) */
+        if (IsLower(c)) c -= 0x20;
+        if (wc != c) return 0;
+    }
+
+    return !(ent[LDIR_Ord] & LLEF) || pos == len;
+}
+
+
+#if _USE_DIR
+static
+int pick_lfn (          /* 1:The fragment is stored, 0:The buffer is too small */
+    char *lfn,          /* Pointer to the LFN buffer */
+    UINT size,          /* Size of the LFN buffer */
+    const BYTE *ent     /* Pointer to the LFN entry */
+)
+{
+    UINT i, pos;
+    WCHAR wc;
+
+
+    pos = ((ent[LDIR_Ord] & 0x3F) - 1) * 13;   /* Position of the fragment in the name */
+    for (i = 0; i < 13; i++, pos++) {
+        wc = LD_WORD(ent+LfnOfs[i]);
+        if (!wc) break;                 /* End of the name */
+        if (pos >= size - 1) return 0;
+        lfn[pos] = (wc < 0x80) ? (char)wc : '?';   /* Non-ASCII characters are not converted */
+    }
+    if (ent[LDIR_Ord] & LLEF) lfn[pos] = 0;     /* Terminate the name */
+
+    return 1;
+}
+#endif
+#endif
+
+
 static
 FRESULT dir_find (
     DIR *dj,        /* Pointer to the directory object linked to the file name */
@@ -512,21 +902,51 @@ FRESULT dir_find (
 )
 {
     FRESULT res;
-    BYTE c;
+    BYTE c, *sec, *ent;
+    UINT n = SS(FatFs) / 32;    /* Entries per sector */
+#if _USE_LFN
+    BYTE a, ord = 0, sum = 0, match = 0;
+#endif
 
 
     res = dir_rewind(dj);           /* Rewind directory object */
     if (res != FR_OK) return res;
 
     do {
-        res = disk_readp(dir, dj->sect, (dj->index % 16) * 32, 32)  /* Read an entry */
-            ? FR_DISK_ERR : FR_OK;
-        if (res != FR_OK) break;
-        c = dir[DIR_Name];  /* First character */
-        if (c == 0) { res = FR_NO_FILE; break; }    /* Reached to end of table */
-        if (!(dir[DIR_Attr] & AM_VOL) && !mem_cmp(dir, dj->fn, 11)) /* Is it a valid entry? */
-            break;
-        res = dir_next(dj);                 /* Next entry */
+        if (disk_getp(&sec, dj->sect)) { res = FR_DISK_ERR; break; }   /* Get the sector */
+        do {                        /* Scan the entries in the sector */
+            ent = sec + (dj->index % n) * 32;
+            c = ent[DIR_Name];      /* First character */
+            if (c == 0) return FR_NO_FILE;  /* Reached to end of table */
+#if _USE_LFN
+            a = ent[DIR_Attr] & AM_MASK;
+            if (a == AM_LFN) {      /* An LFN entry, compare the fragment with the segment */
+                if (c & LLEF && c != 0xE5) {    /* First entry of an LFN */
+                    ord = c & 0x3F; sum = ent[LDIR_Chksum];
+                    match = cmp_lfn(dj->lfn, dj->lfsize, ent);
+                } else if (ord && c == ord - 1 && ent[LDIR_Chksum] == sum) {  /* Next entry */
+                    ord = c;
+                    if (match) match = cmp_lfn(dj->lfn, dj->lfsize, ent);
+                } else {
+                    ord = 0;
+                }
+            } else {
+                if (!(a & AM_VOL) &&
+                    ((ord == 1 && match && sum == sum_sfn(ent)) ||     /* LFN match */
+                     (!(dj->fn[11] & NS_LOSS) && name_cmp(ent, dj->fn)))) {    /* SFN match */
+                    mem_cpy(dir, ent, 32);
+                    return FR_OK;
+                }
+                ord = 0;
+            }
+#else
+            if (!(ent[DIR_Attr] & AM_VOL) && name_cmp(ent, dj->fn)) {  /* Is it a valid entry? */
+                mem_cpy(dir, ent, 32);
+                return FR_OK;
+            }
+#endif
+            res = dir_next(dj);     /* Next entry */
+        } while (res == FR_OK && dj->index % n);
     } while (res == FR_OK);
 
     return res;
@@ -535,6 +955,170 @@ FRESULT dir_find (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Directory index - Hash an SFN and its parent directory                */
+/*-----------------------------------------------------------------------*/
+#if _USE_DIRIDX
+static
+UINT idx_hash (
+    CLUST dclst,        /* Parent directory */
+    const BYTE *name    /* SFN */
+)
+{
+    DWORD h = 2166136261UL ^ dclst;     /* FNV-1a */
+    BYTE i;
+
+
+    for (i = 0; i < 11; i++) h = (h ^ name[i]) * 16777619UL;
+
+    return (UINT)(h ^ (h >> 16)) & (_DIRIDX_SIZE - 1);
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory index - Index all objects of a directory                    */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT idx_build (
+    CLUST dclst         /* Directory to index (0:Root) */
+)
+{
+    FRESULT res;
+    DIR dj;
+    IDXENT *ie;
+    BYTE c, *sec, *ent;
+    UINT i, n = SS(FatFs) / 32;     /* Entries per sector */
+
+
+    if (IdxFull) return FR_NOT_ENABLED;
+
+    dj.sclust = dclst;
+    res = dir_rewind(&dj);
+    while (res == FR_OK) {          /* One sequential pass over the directory */
+        if (disk_getp(&sec, dj.sect)) return FR_DISK_ERR;
+        do {
+            ent = sec + (dj.index % n) * 32;
+            c = ent[DIR_Name];
+            if (c == 0) { res = FR_NO_FILE; break; }    /* Reached to end of table */
+            if (c != 0xE5 && c != '.' && !(ent[DIR_Attr] & AM_VOL)) {
+                if (IdxNents >= _DIRIDX_SIZE / 4 * 3) {  /* Keep the load factor below 3/4 */
+                    IdxFull = 1;
+                    return FR_NOT_ENABLED;
+                }
+                i = idx_hash(dclst, ent);
+                while (DirIdx[i].name[0]) i = (i + 1) & (_DIRIDX_SIZE - 1);    /* Linear probing */
+                ie = &DirIdx[i];
+                ie->dclust = dclst;
+                mem_cpy(ie->name, ent, 11);
+                ie->attr = ent[DIR_Attr];
+                ie->sclust = get_clust(ent);
+                ie->fsize = LD_DWORD(ent+DIR_FileSize);
+#if _USE_WRITE
+                ie->dsect = dj.sect;
+                ie->dindex = dj.index;
+#endif
+                IdxNents++;
+            }
+            res = dir_next(&dj);
+        } while (res == FR_OK && dj.index % n);
+    }
+    if (res != FR_NO_FILE) return res;
+
+    IdxDirs[IdxNdirs++] = dclst;    /* The directory is now complete in the index */
+    if (IdxNdirs == _DIRIDX_DIRS) IdxFull = 1;
+
+    return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory index - Find an object in the directory                     */
+/*-----------------------------------------------------------------------*/
+
+static
+FRESULT idx_find (  /* FR_NOT_ENABLED: The directory is not indexed */
+    DIR *dj,        /* Pointer to the directory object linked to the file name */
+    BYTE *dir       /* 32-byte working buffer */
+)
+{
+    IDXENT *ie;
+    UINT i;
+
+
+    if (!DirIdx) return FR_NOT_ENABLED;
+#if _USE_LFN
+    if (dj->fn[11] & NS_LOSS) return FR_NOT_ENABLED;    /* Only 8.3 names are indexed */
+#endif
+
+    for (i = 0; i < IdxNdirs && IdxDirs[i] != dj->sclust; i++) ;
+    if (i == IdxNdirs && idx_build(dj->sclust) != FR_OK)   /* Index the directory on first use */
+        return FR_NOT_ENABLED;
+
+    i = idx_hash(dj->sclust, dj->fn);
+    for (;;) {
+        ie = &DirIdx[i];
+        if (!ie->name[0]) return FR_NO_FILE;    /* Not in the directory */
+        if (ie->dclust == dj->sclust && name_cmp(ie->name, dj->fn)) break;
+        i = (i + 1) & (_DIRIDX_SIZE - 1);
+    }
+
+    mem_set(dir, 0, 32);            /* Rebuild the directory entry */
+    mem_cpy(dir, ie->name, 11);
+    dir[DIR_Attr] = ie->attr;
+    ST_WORD(dir+DIR_FstClusLO, ie->sclust);
+#if _FS_FAT32
+    ST_WORD(dir+DIR_FstClusHI, ie->sclust >> 16);
+#endif
+    ST_DWORD(dir+DIR_FileSize, ie->fsize);
+#if _USE_WRITE
+    dj->sect = ie->dsect;           /* Location of the entry */
+    dj->index = ie->dindex;
+#endif
+
+    return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Directory index - Update an object after its entry is changed         */
+/*-----------------------------------------------------------------------*/
+#if _USE_WRITE
+static
+void idx_update (
+    CLUST dclst,        /* Parent directory */
+    const BYTE *dir     /* Changed directory entry */
+)
+{
+    IDXENT *ie;
+    UINT i;
+
+
+    if (!DirIdx) return;
+
+    i = idx_hash(dclst, dir);
+    for (;;) {
+        ie = &DirIdx[i];
+        if (!ie->name[0]) return;       /* The directory is not indexed */
+        if (ie->dclust == dclst && name_cmp(ie->name, dir)) break;
+        i = (i + 1) & (_DIRIDX_SIZE - 1);
+    }
+
+    ie->sclust = get_clust((BYTE *)dir);
+    ie->fsize = LD_DWORD(dir+DIR_FileSize);
+}
+#endif
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Read an object from the directory                                     */
 /*-----------------------------------------------------------------------*/
@@ -546,24 +1130,52 @@ FRESULT dir_read (
 )
 {
     FRESULT res;
-    BYTE a, c;
-
-
-    res = FR_NO_FILE;
-    while (dj->sect) {
-        res = disk_readp(dir, dj->sect, (dj->index % 16) * 32, 32)  /* Read an entry */
-            ? FR_DISK_ERR : FR_OK;
-        if (res != FR_OK) break;
-        c = dir[DIR_Name];
-        if (c == 0) { res = FR_NO_FILE; break; }    /* Reached to end of table */
-        a = dir[DIR_Attr] & AM_MASK;
-        if (c != 0xE5 && c != '.' && !(a & AM_VOL)) /* Is it a valid entry? */
-            break;
-        res = dir_next(dj);         /* Next entry */
-        if (res != FR_OK) break;
+    BYTE a, c, *sec, *ent;
+    UINT n = SS(FatFs) / 32;    /* Entries per sector */
+#if _USE_LFN
+    BYTE ord = 0, sum = 0, ok = 0;
+#endif
+
+
+    res = dj->sect ? FR_OK : FR_NO_FILE;
+    while (res == FR_OK) {
+        if (disk_getp(&sec, dj->sect)) { res = FR_DISK_ERR; break; }   /* Get the sector */
+        do {                        /* Scan the entries in the sector */
+            ent = sec + (dj->index % n) * 32;
+            c = ent[DIR_Name];
+            if (c == 0) { res = FR_NO_FILE; break; }    /* Reached to end of table */
+            a = ent[DIR_Attr] & AM_MASK;
+#if _USE_LFN
+            if (a == AM_LFN && dj->lfn) {   /* An LFN entry, store the fragment */
+                if (c & LLEF && c != 0xE5) {    /* First entry of an LFN */
+                    ord = c & 0x3F; sum = ent[LDIR_Chksum];
+                    ok = pick_lfn(dj->lfn, dj->lfsize, ent);
+                } else if (ord && c == ord - 1 && ent[LDIR_Chksum] == sum) {  /* Next entry */
+                    ord = c;
+                    if (ok) ok = pick_lfn(dj->lfn, dj->lfsize, ent);
+                } else {
+                    ord = 0;
+                }
+                res = dir_next(dj);
+                continue;
+            }
+#endif
+            if (c != 0xE5 && c != '.' && !(a & AM_VOL)) {   /* Is it a valid entry? */
+#if _USE_LFN
+                if (dj->lfn && !(ord == 1 && ok && sum == sum_sfn(ent)))   /* No LFN for this entry */
+                    dj->lfn[0] = 0;
+#endif
+                mem_cpy(dir, ent, 32);
+                return FR_OK;
+            }
+#if _USE_LFN
+            ord = 0;
+#endif
+            res = dir_next(dj);     /* Next entry */
+        } while (res == FR_OK && dj->index % n);
     }
 
-    if (res != FR_OK) dj->sect = 0;
+    dj->sect = 0;
 
     return res;
 }
@@ -582,7 +1194,7 @@ FRESULT create_name (
     const char **path   /* Pointer to pointer to the segment in the path string */
 )
 {
-    BYTE c, ni, si, i, *sfn;
+    BYTE c, ni, si, i, f, *sfn;
     const char *p;
 #if _USE_LCC
 #ifdef _EXCVT
@@ -593,8 +1205,20 @@ FRESULT create_name (
     /* Create file name in directory form */
     sfn = dj->fn;
     mem_set(sfn, ' ', 11);
-    si = i = 0; ni = 8;
+    si = i = f = 0; ni = 8;
     p = *path;
+#if _USE_LFN
+    dj->lfn = (char*)p;                 /* The segment is matched against LFNs as is */
+    for (;;) {
+        c = p[si++];
+        if (c < ' ' || c == '/') break;     /* Break on end of segment */
+        if (c == ' ') { f = NS_LOSS; continue; }    /* Not in an 8.3 name */
+        if (c == '.' || i >= ni) {
+            if (ni != 8 || c != '.' || !i) { f = NS_LOSS; continue; }  /* Not an 8.3 name, go on to the end of segment */
+            i = 8; ni = 11;
+            continue;
+        }
+#else
     for (;;) {
         c = p[si++];
         if (c <= ' ' || c == '/') break;    /* Break on end of segment */
@@ -603,6 +1227,7 @@ FRESULT create_name (
             i = 8; ni = 11;
             continue;
         }
+#endif
 #if _USE_LCC
 #ifdef _EXCVT
         if (c >= 0x80)                  /* To upper extended char (SBCS) */
@@ -621,7 +1246,12 @@ FRESULT create_name (
     }
     *path = &p[si];                     /* Rerurn pointer to the next segment */
 
-    sfn[11] = (c <= ' ') ? 1 : 0;       /* Set last segment flag if end of path */
+#if _USE_LFN
+    dj->lfsize = si - 1;                /* Length of the segment */
+    sfn[11] = f | ((c < ' ') ? NS_LAST : 0);    /* Set last segment flag if end of path */
+#else
+    sfn[11] = (c <= ' ') ? NS_LAST : 0; /* Set last segment flag if end of path */
+#endif
 
     return FR_OK;
 }
@@ -666,6 +1296,9 @@ void get_fileinfo (     /* No return code */
         fno->ftime = LD_WORD(dir+DIR_WrtTime);      /* Time */
     }
     *p = 0;
+#if _USE_LFN
+    if (!dj->sect && fno->lfname && fno->lfsize) fno->lfname[0] = 0;
+#endif
 }
 #endif /* _USE_DIR */
 
@@ -697,9 +1330,13 @@ FRESULT follow_path (   /* FR_OK(0): successful, !=0: error code */
         for (;;) {
             res = create_name(dj, &path);   /* Get a segment */
             if (res != FR_OK) break;
+#if _USE_DIRIDX
+            res = idx_find(dj, dir);        /* Look it up in the directory index */
+            if (res == FR_NOT_ENABLED)
+#endif
             res = dir_find(dj, dir);        /* Find it */
             if (res != FR_OK) break;        /* Could not find the object */
-            if (dj->fn[11]) break;          /* Last segment match. Function completed. */
+            if (dj->fn[11] & NS_LAST) break;    /* Last segment match. Function completed. */
             if (!(dir[DIR_Attr] & AM_DIR)) { /* Cannot follow path because it is a file */
                 res = FR_NO_FILE; break;
             }
@@ -713,24 +1350,51 @@ FRESULT follow_path (   /* FR_OK(0): successful, !=0: error code */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Update the directory entry of a file after it has grown               */
+/*-----------------------------------------------------------------------*/
+#if _USE_WRITE
+static
+FRESULT dir_update (
+    FIL *fp         /* Pointer to the file object */
+)
+{
+    BYTE dir[32];
+    FATFS *fs = FatFs;
+
+
+    if (disk_readp(dir, fp->dir_sect, fp->dir_ofs, 32)) return FR_DISK_ERR;
+    if (_FS_32ONLY || (_FS_FAT32 && fs->fs_type == FS_FAT32))
+        ST_WORD(dir+DIR_FstClusHI, (DWORD)fp->org_clust >> 16);
+    ST_WORD(dir+DIR_FstClusLO, fp->org_clust);
+    ST_DWORD(dir+DIR_FileSize, fp->fsize);
+    if (put_sect(fp->dir_sect, fp->dir_ofs, dir, 32)) return FR_DISK_ERR;
+#if _USE_DIRIDX
+    idx_update(fp->dir_clust, dir);
+#endif
+
+    return FR_OK;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Check a sector if it is an FAT boot record                            */
 /*-----------------------------------------------------------------------*/
 
 static
-BYTE check_fs ( /* 0:The FAT boot record, 1:Valid boot record but not an FAT, 2:Not a boot record, 3:Error */
-    BYTE *buf,  /* Working buffer */
-    DWORD sect  /* Sector# (lba) to check if it is an FAT boot record or not */
+BYTE check_fs ( /* 0:The FAT boot record, 1:Valid boot record but not an FAT, 2:Not a boot record */
+    const BYTE *buf /* Pointer to the sector to check if it is an FAT boot record or not */
 )
 {
-    if (disk_readp(buf, sect, 510, 2))      /* Read the boot record */
-        return 3;
-    if (LD_WORD(buf) != 0xAA55)             /* Check record signature */
+    if (LD_WORD(buf+510) != 0xAA55)         /* Check record signature */
         return 2;
 
-    if (!_FS_32ONLY && !disk_readp(buf, sect, BS_FilSysType, 2) && LD_WORD(buf) == 0x4146)  /* Check FAT12/16 */
+    if (!_FS_32ONLY && LD_WORD(buf+BS_FilSysType) == 0x4146)    /* Check FAT12/16 */
         return 0;
-    if (_FS_FAT32 && !disk_readp(buf, sect, BS_FilSysType32, 2) && LD_WORD(buf) == 0x4146)  /* Check FAT32 */
+    if (_FS_FAT32 && LD_WORD(buf+BS_FilSysType32) == 0x4146)    /* Check FAT32 */
         return 0;
     return 1;
 }
@@ -754,8 +1418,12 @@ FRESULT pf_mount (
     FATFS *fs       /* Pointer to new file system object */
 )
 {
-    BYTE fmt, buf[36];
+    BYTE fmt, *buf;
     DWORD bsect, fsize, tsect, mclst;
+    UINT ss, act;
+#if _USE_WRITE
+    UINT fsi;
+#endif
 
 
     FatFs = 0;
@@ -763,37 +1431,44 @@ FRESULT pf_mount (
     if (disk_initialize() & STA_NOINIT) /* Check if the drive is ready or not */
         return FR_NOT_READY;
 
-    /* Search FAT partition on the drive */
+    /* Search FAT partition on the drive, the sectors are parsed in the cache */
     bsect = 0;
-    fmt = check_fs(buf, bsect);         /* Check sector 0 as an SFD format */
+    if (disk_getp(&buf, bsect)) return FR_DISK_ERR;
+    fmt = check_fs(buf);                /* Check sector 0 as an SFD format */
     if (fmt == 1) {                     /* Not an FAT boot record, it may be FDISK format */
         /* Check a partition listed in top of the partition table */
-        if (disk_readp(buf, bsect, MBR_Table, 16)) {    /* 1st partition entry */
-            fmt = 3;
-        } else {
-            if (buf[4]) {                   /* Is the partition existing? */
-                bsect = LD_DWORD(&buf[8]);  /* Partition offset in LBA */
-                fmt = check_fs(buf, bsect); /* Check the partition */
-            }
+        if (buf[MBR_Table+4]) {         /* Is the partition existing? */
+            bsect = LD_DWORD(buf+MBR_Table+8);  /* Partition offset in LBA */
+            /* Read the VBR along with the FSInfo sector and the top of the FAT */
+            if (disk_prefetch(bsect, MOUNT_WINDOW) || disk_getp(&buf, bsect)) return FR_DISK_ERR;
+            fmt = check_fs(buf);        /* Check the partition */
         }
     }
-    if (fmt == 3) return FR_DISK_ERR;
     if (fmt) return FR_NO_FILESYSTEM;   /* No valid FAT patition is found */
 
     /* Initialize the file system object */
-    if (disk_readp(buf, bsect, 13, sizeof (buf))) return FR_DISK_ERR;
+    ss = LD_WORD(buf+BPB_BytsPerSec);                   /* Bytes per sector */
+    if (ss < 512 || ss > _MAX_SS || (ss & (ss - 1))) return FR_NO_FILESYSTEM;
+#if _MAX_SS != 512
+    fs->ssize = (WORD)ss;
+#endif
 
-    fsize = LD_WORD(buf+BPB_FATSz16-13);                /* Number of sectors per FAT */
-    if (!fsize) fsize = LD_DWORD(buf+BPB_FATSz32-13);
+    fsize = LD_WORD(buf+BPB_FATSz16);                   /* Number of sectors per FAT */
+    if (!fsize) fsize = LD_DWORD(buf+BPB_FATSz32);
 
-    fsize *= buf[BPB_NumFATs-13];                       /* Number of sectors in FAT area */
-    fs->fatbase = bsect + LD_WORD(buf+BPB_RsvdSecCnt-13); /* FAT start sector (lba) */
-    fs->csize = buf[BPB_SecPerClus-13];                 /* Number of sectors per cluster */
-    fs->n_rootdir = LD_WORD(buf+BPB_RootEntCnt-13);     /* Nmuber of root directory entries */
-    tsect = LD_WORD(buf+BPB_TotSec16-13);               /* Number of sectors on the file system */
-    if (!tsect) tsect = LD_DWORD(buf+BPB_TotSec32-13);
+#if _USE_WRITE
+    fs->fsize = fsize;
+    fs->n_fats = buf[BPB_NumFATs];                      /* Number of FAT copies */
+    fsi = LD_WORD(buf+BPB_FSInfo);                      /* FSInfo sector (FAT32) */
+#endif
+    fsize *= buf[BPB_NumFATs];                          /* Number of sectors in FAT area */
+    fs->fatbase = bsect + LD_WORD(buf+BPB_RsvdSecCnt);  /* FAT start sector (lba) */
+    fs->csize = buf[BPB_SecPerClus];                    /* Number of sectors per cluster */
+    fs->n_rootdir = LD_WORD(buf+BPB_RootEntCnt);        /* Nmuber of root directory entries */
+    tsect = LD_WORD(buf+BPB_TotSec16);                  /* Number of sectors on the file system */
+    if (!tsect) tsect = LD_DWORD(buf+BPB_TotSec32);
     mclst = (tsect                      /* Last cluster# + 1 */
-        - LD_WORD(buf+BPB_RsvdSecCnt-13) - fsize - fs->n_rootdir / 16
+        - LD_WORD(buf+BPB_RsvdSecCnt) - fsize - fs->n_rootdir / (ss / 32)
         ) / fs->csize + 2;
     fs->n_fatent = (CLUST)mclst;
 
@@ -808,14 +1483,63 @@ FRESULT pf_mount (
     fs->fs_type = fmt;
 
     if (_FS_32ONLY || (_FS_FAT32 && fmt == FS_FAT32))
-        fs->dirbase = LD_DWORD(buf+(BPB_RootClus-13));  /* Root directory start cluster */
+        fs->dirbase = LD_DWORD(buf+BPB_RootClus);       /* Root directory start cluster */
     else
         fs->dirbase = fs->fatbase + fsize;              /* Root directory start sector (lba) */
-    fs->database = fs->fatbase + fsize + fs->n_rootdir / 16;    /* Data start sector (lba) */
+    fs->database = fs->fatbase + fsize + fs->n_rootdir / (ss / 32); /* Data start sector (lba) */
+
+    /* FAT mirroring disabled (BPB_ExtFlags bit 7): only the active FAT (bits 0-3) is read and written */
+    if ((_FS_32ONLY || (_FS_FAT32 && fmt == FS_FAT32)) && (LD_WORD(buf+BPB_ExtFlags) & 0x80)) {
+        act = LD_WORD(buf+BPB_ExtFlags) & 0x0F;
+        if (act >= buf[BPB_NumFATs]) return FR_NO_FILESYSTEM;
+        fs->fatbase += act * (fsize / buf[BPB_NumFATs]);
+#if _USE_WRITE
+        fs->n_fats = 1;
+#endif
+    }
 
-    fs->flag = 0;
     FatFs = fs;
 
+#if _USE_WRITE
+    /* Load the allocation hints from the FSInfo, it was read along with the VBR */
+    fs->fsi_sect = 0; fs->fsi_flag = 0;
+    fs->last_clust = 1; fs->free_clust = 0xFFFFFFFF;
+    if ((_FS_32ONLY || (_FS_FAT32 && fmt == FS_FAT32)) && fsi && !disk_getp(&buf, bsect + fsi) &&
+        LD_DWORD(buf+FSI_LeadSig) == 0x41615252 && LD_DWORD(buf+FSI_StrucSig) == 0x61417272) {
+        fs->fsi_sect = bsect + fsi;
+        fs->last_clust = (CLUST)LD_DWORD(buf+FSI_Nxt_Free);
+        fs->free_clust = LD_DWORD(buf+FSI_Free_Count);
+        if (fs->last_clust < 2 || fs->last_clust >= mclst) fs->last_clust = 1;
+        if (fs->free_clust > mclst - 2) fs->free_clust = 0xFFFFFFFF;
+    }
+
+#if _FREEMAP_SIZE
+    /* The free cluster bitmap is filled on the first allocation */
+    if (!MapBuf) MapBuf = pf_memalloc(_FREEMAP_SIZE);
+    FreeMap = 0;
+    if (MapBuf && fmt != FS_FAT12 && (mclst + 7) / 8 + (fs->fsize + 7) / 8 <= _FREEMAP_SIZE) {
+        FreeMap = MapBuf;
+        FreeMapLd = MapBuf + (mclst + 7) / 8;
+        mem_set(MapBuf, 0, (mclst + 7) / 8 + (fs->fsize + 7) / 8);
+    }
+#endif
+#endif
+
+    /* Prefetch the top of the root directory (errors show up on the actual read) */
+    if (_FS_32ONLY || (_FS_FAT32 && fmt == FS_FAT32))
+        disk_prefetch(clust2sect(fs->dirbase), fs->csize);
+    else
+        disk_prefetch(fs->dirbase, fs->n_rootdir / (ss / 32));
+
+#if _USE_DIRIDX
+    if (!DirIdx) DirIdx = pf_memalloc(_DIRIDX_SIZE * sizeof (IDXENT));
+    if (DirIdx) {
+        mem_set(DirIdx, 0, _DIRIDX_SIZE * sizeof (IDXENT));
+        IdxNdirs = IdxNents = 0; IdxFull = 0;
+        idx_build(0);                   /* Index the root directory */
+    }
+#endif
+
     return FR_OK;
 }
 
@@ -827,6 +1551,7 @@ FRESULT pf_mount (
 /*-----------------------------------------------------------------------*/
 
 FRESULT pf_open (
+    FIL *fp,            /* Pointer to the blank file object */
     const char *path    /* Pointer to the file name */
 )
 {
@@ -838,17 +1563,28 @@ FRESULT pf_open (
 
     if (!fs) return FR_NOT_ENABLED;     /* Check file system */
 
-    fs->flag = 0;
+    fp->flag = 0;
     dj.fn = sp;
     res = follow_path(&dj, dir, path);  /* Follow the file path */
     if (res != FR_OK) return res;       /* Follow failed */
     if (!dir[0] || (dir[DIR_Attr] & AM_DIR))    /* It is a directory */
         return FR_NO_FILE;
 
-    fs->org_clust = get_clust(dir);     /* File start cluster */
-    fs->fsize = LD_DWORD(dir+DIR_FileSize); /* File size */
-    fs->fptr = 0;                       /* File pointer */
-    fs->flag = FA_OPENED;
+    fp->org_clust = get_clust(dir);     /* File start cluster */
+    fp->fsize = LD_DWORD(dir+DIR_FileSize); /* File size */
+    fp->fptr = 0;                       /* File pointer */
+    fp->flag = FA_OPENED;
+#if _LSEEK_CKPTS
+    mem_set(fp->ckpt, 0, sizeof fp->ckpt);  /* Spread the checkpoints over the chain */
+    fp->ckshift = 0;
+    while (((fp->fsize / SS(fs) / fs->csize) >> fp->ckshift) >= _LSEEK_CKPTS) fp->ckshift++;
+    fp->ckpt[0] = fp->org_clust;
+#endif
+#if _USE_WRITE
+    fp->dir_clust = dj.sclust;          /* Location of the directory entry */
+    fp->dir_sect = dj.sect;
+    fp->dir_ofs = (WORD)(dj.index % (SS(fs) / 32) * 32);
+#endif
 
     return FR_OK;
 }
@@ -862,52 +1598,155 @@ FRESULT pf_open (
 #if _USE_READ
 
 FRESULT pf_read (
-    void* buff,     /* Pointer to the read buffer (NULL:Forward data to the stream)*/
+    FIL* fp,        /* Pointer to the file object */
+    void* buff,     /* Pointer to the read buffer (NULL:Skip the data) */
     UINT btr,       /* Number of bytes to read */
     UINT* br        /* Pointer to number of bytes read */
 )
 {
     DRESULT dr;
-    CLUST clst;
-    DWORD sect, remain;
-    UINT rcnt;
+    CLUST clst, nclst;
+    DWORD sect, remain, ci;
+    UINT rcnt, cc, ns;
     BYTE cs, *rbuff = buff;
     FATFS *fs = FatFs;
 
 
     *br = 0;
     if (!fs) return FR_NOT_ENABLED;     /* Check file system */
-    if (!(fs->flag & FA_OPENED))        /* Check if opened */
+    if (!(fp->flag & FA_OPENED))        /* Check if opened */
         return FR_NOT_OPENED;
 
-    remain = fs->fsize - fs->fptr;
+    remain = fp->fsize - fp->fptr;
     if (btr > remain) btr = (UINT)remain;           /* Truncate btr by remaining bytes */
 
     while (btr) {                                   /* Repeat until all data transferred */
-        if ((fs->fptr % 512) == 0) {                /* On the sector boundary? */
-            cs = (BYTE)(fs->fptr / 512 & (fs->csize - 1));  /* Sector offset in the cluster */
+        if ((fp->fptr % SS(fs)) == 0) {             /* On the sector boundary? */
+            cs = (BYTE)(fp->fptr / SS(fs) & (fs->csize - 1));   /* Sector offset in the cluster */
             if (!cs) {                              /* On the cluster boundary? */
-                if (fs->fptr == 0)                  /* On the top of the file? */
-                    clst = fs->org_clust;
+                if (fp->fptr == 0)                  /* On the top of the file? */
+                    clst = fp->org_clust;
                 else
-                    clst = get_fat(fs->curr_clust);
+                    clst = get_fat(fp->curr_clust);
                 if (clst <= 1) ABORT(FR_DISK_ERR);
-                fs->curr_clust = clst;              /* Update current cluster */
+                fp->curr_clust = clst;              /* Update current cluster */
+#if _LSEEK_CKPTS
+                set_ckpt(fp, fp->fptr / SS(fs) / fs->csize, clst);
+#endif
             }
-            sect = clust2sect(fs->curr_clust);      /* Get current sector */
+            sect = clust2sect(fp->curr_clust);      /* Get current sector */
             if (!sect) ABORT(FR_DISK_ERR);
-            fs->dsect = sect + cs;
+            fp->dsect = sect + cs;
         }
-        rcnt = 512 - (UINT)fs->fptr % 512;          /* Get partial sector data from sector buffer */
-        if (rcnt > btr) rcnt = btr;
-        dr = disk_readp(!buff ? 0 : rbuff, fs->dsect, (UINT)fs->fptr % 512, rcnt);
-        if (dr) ABORT(FR_DISK_ERR);
-        fs->fptr += rcnt; rbuff += rcnt;            /* Update pointers and counters */
+        rcnt = SS(fs) - (UINT)fp->fptr % SS(fs);    /* Get partial sector data from sector buffer */
+        if (buff && rcnt == SS(fs) && btr >= SS(fs)) {  /* Whole sectors? Read them straight into the buffer */
+            cc = btr / SS(fs);
+            ns = fs->csize - (UINT)(fp->fptr / SS(fs) & (fs->csize - 1));   /* Sectors left in the cluster */
+            clst = fp->curr_clust;
+            ci = fp->fptr / SS(fs) / fs->csize;     /* Cluster index in the file */
+            while (cc > ns) {                       /* Extend the run over contiguous clusters */
+                nclst = get_fat(clst);
+                if (nclst != clst + 1) break;
+                clst = nclst; ns += fs->csize;
+#if _LSEEK_CKPTS
+                set_ckpt(fp, ++ci, clst);
+#endif
+            }
+            if (cc > ns) cc = ns;
+            dr = disk_readm(rbuff, fp->dsect, cc);
+            if (dr) ABORT(FR_DISK_ERR);
+            fp->curr_clust = clst;                  /* Last cluster of the run */
+            rcnt = cc * SS(fs);
+        } else {
+            if (rcnt > btr) rcnt = btr;
+            if (buff) {                             /* Skipped data is not read at all */
+                dr = disk_readp(rbuff, fp->dsect, (UINT)fp->fptr % SS(fs), rcnt);
+                if (dr) ABORT(FR_DISK_ERR);
+            }
+        }
+        fp->fptr += rcnt; rbuff += rcnt;            /* Update pointers and counters */
         btr -= rcnt; *br += rcnt;
     }
 
     return FR_OK;
 }
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read File in Place                                                    */
+/*-----------------------------------------------------------------------*/
+
+FRESULT pf_read_stream (
+    FIL* fp,        /* Pointer to the file object */
+    UINT (*func)(void*, const BYTE*, UINT), /* Stream function, returns the number of bytes it took */
+    void* ctx,      /* Context passed to the stream function */
+    UINT btr,       /* Number of bytes to read */
+    UINT* br        /* Pointer to number of bytes read */
+)
+{
+    CLUST clst, nclst;
+    DWORD sect, ci;
+    UINT ofs, cc, ns, rcnt, n;
+    BYTE cs, *data;
+    FATFS *fs = FatFs;
+
+
+    *br = 0;
+    if (!fs) return FR_NOT_ENABLED;     /* Check file system */
+    if (!(fp->flag & FA_OPENED))        /* Check if opened */
+        return FR_NOT_OPENED;
+
+    if (btr > fp->fsize - fp->fptr) btr = (UINT)(fp->fsize - fp->fptr);   /* Truncate btr by remaining bytes */
+
+    while (btr) {                                   /* Repeat until all data transferred */
+        if ((fp->fptr % SS(fs)) == 0) {             /* On the sector boundary? */
+            cs = (BYTE)(fp->fptr / SS(fs) & (fs->csize - 1));   /* Sector offset in the cluster */
+            if (!cs) {                              /* On the cluster boundary? */
+                if (fp->fptr == 0)                  /* On the top of the file? */
+                    clst = fp->org_clust;
+                else
+                    clst = get_fat(fp->curr_clust);
+                if (clst <= 1) ABORT(FR_DISK_ERR);
+                fp->curr_clust = clst;              /* Update current cluster */
+#if _LSEEK_CKPTS
+                set_ckpt(fp, fp->fptr / SS(fs) / fs->csize, clst);
+#endif
+            }
+            sect = clust2sect(fp->curr_clust);      /* Get current sector */
+            if (!sect) ABORT(FR_DISK_ERR);
+            fp->dsect = sect + cs;
+        }
+        ofs = (UINT)fp->fptr % SS(fs);
+        cc = (ofs + btr + SS(fs) - 1) / SS(fs);    /* Sectors holding the rest of the data */
+        ns = fs->csize - (UINT)(fp->fptr / SS(fs) & (fs->csize - 1));   /* Sectors left in the cluster */
+        clst = fp->curr_clust;
+        ci = fp->fptr / SS(fs) / fs->csize;         /* Cluster index in the file */
+        while (cc > ns) {                           /* Extend the run over contiguous clusters */
+            nclst = get_fat(clst);
+            if (nclst != clst + 1) break;
+            clst = nclst; ns += fs->csize;
+#if _LSEEK_CKPTS
+            set_ckpt(fp, ++ci, clst);
+#endif
+        }
+        if (cc > ns) cc = ns;
+        if (disk_getm(&data, fp->dsect, &cc)) ABORT(FR_DISK_ERR);  /* Get as much of the run as is cached */
+        rcnt = cc * SS(fs) - ofs;
+        if (rcnt > btr) rcnt = btr;
+        n = func(ctx, data + ofs, rcnt);            /* Hand the data to the stream in place */
+        if (n > rcnt) n = rcnt;
+        if (n) {                                    /* Move to the last byte taken, the run is contiguous */
+            fp->curr_clust += (CLUST)(((DWORD)(fp->fptr / SS(fs) & (fs->csize - 1)) * SS(fs) + ofs + n - 1) / ((DWORD)fs->csize * SS(fs)));
+            fp->dsect += (ofs + n - 1) / SS(fs);
+            fp->fptr += n; btr -= n; *br += n;
+        }
+        if (n < rcnt) break;                        /* The stream does not take more */
+    }
+
+    return FR_OK;
+}
 #endif
 
 
@@ -918,63 +1757,97 @@ FRESULT pf_read (
 #if _USE_WRITE
 
 FRESULT pf_write (
+    FIL* fp,            /* Pointer to the file object */
     const void* buff,   /* Pointer to the data to be written */
-    UINT btw,           /* Number of bytes to write (0:Finalize the current write operation) */
+    UINT btw,           /* Number of bytes to write (0:No operation) */
     UINT* bw            /* Pointer to number of bytes written */
 )
 {
     CLUST clst;
-    DWORD sect, remain;
+    DWORD sect;
     const BYTE *p = buff;
-    BYTE cs;
+    BYTE cs, grown = 0;
     UINT wcnt;
     FATFS *fs = FatFs;
 
 
     *bw = 0;
     if (!fs) return FR_NOT_ENABLED;     /* Check file system */
-    if (!(fs->flag & FA_OPENED))        /* Check if opened */
+    if (!(fp->flag & FA_OPENED))        /* Check if opened */
         return FR_NOT_OPENED;
 
-    if (!btw) {     /* Finalize request */
-        if ((fs->flag & FA__WIP) && disk_writep(0, 0)) ABORT(FR_DISK_ERR);
-        fs->flag &= ~FA__WIP;
-        return FR_OK;
-    } else {        /* Write data request */
-        if (!(fs->flag & FA__WIP))      /* Round-down fptr to the sector boundary */
-            fs->fptr &= 0xFFFFFE00;
-    }
-    remain = fs->fsize - fs->fptr;
-    if (btw > remain) btw = (UINT)remain;           /* Truncate btw by remaining bytes */
-
     while (btw) {                                   /* Repeat until all data transferred */
-        if ((UINT)fs->fptr % 512 == 0) {            /* On the sector boundary? */
-            cs = (BYTE)(fs->fptr / 512 & (fs->csize - 1));  /* Sector offset in the cluster */
+        if ((UINT)fp->fptr % SS(fs) == 0) {         /* On the sector boundary? */
+            cs = (BYTE)(fp->fptr / SS(fs) & (fs->csize - 1));   /* Sector offset in the cluster */
             if (!cs) {                              /* On the cluster boundary? */
-                if (fs->fptr == 0)                  /* On the top of the file? */
-                    clst = fs->org_clust;
+                if (fp->fptr == 0)                  /* On the top of the file? */
+                    clst = fp->org_clust;
                 else
-                    clst = get_fat(fs->curr_clust);
-                if (clst <= 1) ABORT(FR_DISK_ERR);
-                fs->curr_clust = clst;              /* Update current cluster */
+                    clst = get_fat(fp->curr_clust);
+                if (clst == 0 || clst >= fs->n_fatent) {    /* No chain yet or end of the chain? */
+                    clst = create_chain(fp->fptr ? fp->curr_clust : 0);  /* Allocate a cluster */
+                    if (clst == 0) break;           /* Disk full, the write stops short */
+                    if (!fp->org_clust) {           /* The first cluster of the file */
+                        fp->org_clust = clst;
+#if _LSEEK_CKPTS
+                        fp->ckpt[0] = clst;
+#endif
+                    }
+                    grown = 1;
+                }
+                if (clst == 1) ABORT(FR_DISK_ERR);
+                fp->curr_clust = clst;              /* Update current cluster */
             }
-            sect = clust2sect(fs->curr_clust);      /* Get current sector */
+            sect = clust2sect(fp->curr_clust);      /* Get current sector */
             if (!sect) ABORT(FR_DISK_ERR);
-            fs->dsect = sect + cs;
-            if (disk_writep(0, fs->dsect)) ABORT(FR_DISK_ERR);  /* Initiate a sector write operation */
-            fs->flag |= FA__WIP;
+            fp->dsect = sect + cs;
         }
-        wcnt = 512 - (UINT)fs->fptr % 512;          /* Number of bytes to write to the sector */
+        wcnt = SS(fs) - (UINT)fp->fptr % SS(fs);    /* Number of bytes to write to the sector */
         if (wcnt > btw) wcnt = btw;
-        if (disk_writep((BYTE *)p, wcnt)) ABORT(FR_DISK_ERR);   /* Send data to the sector */
-        fs->fptr += wcnt; p += wcnt;                /* Update pointers and counters */
+        /* The sector is written back later, so each call completes its sector write and
+           files do not share a write in progress */
+        if (disk_writep(0, fp->dsect) ||                /* Initiate a sector write operation */
+            (!((UINT)fp->fptr % SS(fs)) && fp->fptr >= fp->fsize && disk_blankp()) ||    /* Nothing to keep past the end of the file */
+            disk_seekp((UINT)fp->fptr % SS(fs)) ||      /* Move to the file pointer */
+            disk_writep((BYTE *)p, wcnt) ||             /* Send data to the sector */
+            disk_writep(0, 0))                          /* Finalize the sector write operation */
+            ABORT(FR_DISK_ERR);
+        fp->fptr += wcnt; p += wcnt;                /* Update pointers and counters */
         btw -= wcnt; *bw += wcnt;
-        if ((UINT)fs->fptr % 512 == 0) {
-            if (disk_writep(0, 0)) ABORT(FR_DISK_ERR);  /* Finalize the currtent secter write operation */
-            fs->flag &= ~FA__WIP;
-        }
     }
 
+    if (fp->fptr > fp->fsize) {                     /* The file has grown? */
+        fp->fsize = fp->fptr;
+        grown = 1;
+    }
+    if (grown && dir_update(fp)) ABORT(FR_DISK_ERR);    /* Record the new size and chain in the directory */
+
+    return FR_OK;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Synchronize the File                                                  */
+/*-----------------------------------------------------------------------*/
+
+FRESULT pf_sync (void)
+{
+    BYTE buf[8];
+    FATFS *fs = FatFs;
+
+
+    if (!fs) return FR_NOT_ENABLED;     /* Check file system */
+
+    if (fs->fsi_flag && fs->fsi_sect) {     /* Update the FSInfo after allocations */
+        ST_DWORD(buf, fs->free_clust);
+        ST_DWORD(buf+4, fs->last_clust);
+        if (put_sect(fs->fsi_sect, FSI_Free_Count, buf, 8)) return FR_DISK_ERR;
+    }
+    fs->fsi_flag = 0;
+
+    if (disk_sync()) return FR_DISK_ERR;    /* Write back the pending sectors of all files */
+
     return FR_OK;
 }
 #endif
@@ -987,43 +1860,57 @@ FRESULT pf_write (
 #if _USE_LSEEK
 
 FRESULT pf_lseek (
+    FIL* fp,        /* Pointer to the file object */
     DWORD ofs       /* File pointer from top of file */
 )
 {
     CLUST clst;
-    DWORD bcs, sect, ifptr;
+    DWORD bcs, sect, ifptr, n, ci;
+#if _LSEEK_CKPTS
+    DWORD k;
+#endif
     FATFS *fs = FatFs;
 
 
     if (!fs) return FR_NOT_ENABLED;     /* Check file system */
-    if (!(fs->flag & FA_OPENED))        /* Check if opened */
+    if (!(fp->flag & FA_OPENED))        /* Check if opened */
             return FR_NOT_OPENED;
 
-    if (ofs > fs->fsize) ofs = fs->fsize;   /* Clip offset with the file size */
-    ifptr = fs->fptr;
-    fs->fptr = 0;
+    if (ofs > fp->fsize) ofs = fp->fsize;   /* Clip offset with the file size */
+    ifptr = fp->fptr;
+    fp->fptr = 0;
     if (ofs > 0) {
-        bcs = (DWORD)fs->csize * 512;   /* Cluster size (byte) */
-        if (ifptr > 0 &&
-            (ofs - 1) / bcs >= (ifptr - 1) / bcs) { /* When seek to same or following cluster, */
-            fs->fptr = (ifptr - 1) & ~(bcs - 1);    /* start from the current cluster */
-            ofs -= fs->fptr;
-            clst = fs->curr_clust;
+        bcs = (DWORD)fs->csize * SS(fs);    /* Cluster size (byte) */
+        ci = (ofs - 1) / bcs;               /* Cluster index of the new position */
+        if (ifptr > 0 && ci >= (ifptr - 1) / bcs) { /* When seek to same or following cluster, */
+            n = (ifptr - 1) / bcs;          /* start from the current cluster */
+            clst = fp->curr_clust;
         } else {                            /* When seek to back cluster, */
-            clst = fs->org_clust;           /* start from the first cluster */
-            fs->curr_clust = clst;
+            n = 0;                          /* start from the first cluster */
+            clst = fp->org_clust;
+        }
+#if _LSEEK_CKPTS
+        k = ci >> fp->ckshift;              /* Nearest known checkpoint before the position */
+        if (k >= _LSEEK_CKPTS) k = _LSEEK_CKPTS - 1;
+        while (k && !fp->ckpt[k]) k--;
+        if ((k << fp->ckshift) > n) {       /* Resume from it when it is closer */
+            n = k << fp->ckshift;
+            clst = fp->ckpt[k];
         }
-        while (ofs > bcs) {             /* Cluster following loop */
+#endif
+        while (n < ci) {                /* Cluster following loop */
             clst = get_fat(clst);       /* Follow cluster chain */
             if (clst <= 1 || clst >= fs->n_fatent) ABORT(FR_DISK_ERR);
-            fs->curr_clust = clst;
-            fs->fptr += bcs;
-            ofs -= bcs;
+            n++;
+#if _LSEEK_CKPTS
+            set_ckpt(fp, n, clst);
+#endif
         }
-        fs->fptr += ofs;
+        fp->curr_clust = clst;
+        fp->fptr = ofs;
         sect = clust2sect(clst);        /* Current sector */
         if (!sect) ABORT(FR_DISK_ERR);
-        fs->dsect = sect + (fs->fptr / 512 & (fs->csize - 1));
+        fp->dsect = sect + (fp->fptr / SS(fs) & (fs->csize - 1));
     }
 
     return FR_OK;
@@ -1091,6 +1978,10 @@ FRESULT pf_readdir (
         if (!fno) {
             res = dir_rewind(dj);
         } else {
+#if _USE_LFN
+            dj->lfn = fno->lfsize ? fno->lfname : 0;    /* LFN buffer */
+            dj->lfsize = fno->lfsize;
+#endif
             res = dir_read(dj, dir);    /* Get current directory item */
             if (res == FR_NO_FILE) res = FR_OK;
             if (res == FR_OK) {             /* A valid entry is found */
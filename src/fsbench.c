@@ -0,0 +1,491 @@
+﻿
+/*
+
+    This file is part of x86_vbrkit.
+
+    Copyright 2017 / the`janitor / < email: base64dec(dGhlLmphbml0b3JAcHJvdG9ubWFpbC5jb20=) >
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+#define _POSIX_C_SOURCE 200809L /* clock_gettime() and mmap() with -std=c99 */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "types.h"
+#include "disk.h"
+#include "pff.h"
+
+/*
+    Host build of the file system code (pff.c, diskio.c) over a memory
+    mapped image, the disk_io() below stands in for the INT 13h layer of
+    disk.c and splits the requests in the BIOS calls the loader would make
+*/
+#define BENCH_FILE          "bench.bin"
+#define BENCH_READ_SIZE     0x1000
+#define BENCH_READS         1000
+#define BENCH_DRIVE         0x80
+
+typedef struct
+{
+    uint32_t    requests;   /* disk_io() calls */
+    uint32_t    bios_calls; /* INT 13h calls, after splitting in chunks */
+    uint64_t    sectors;
+
+} bench_stats_t;
+
+/******************************************************************************/
+
+static uint8_t* image;
+static uint64_t image_sectors;
+static uint32_t image_sector_size = SECTOR_SIZE_DEFAULT;
+
+static bench_stats_t stats;
+
+/* request trace, in the format of disk.h (DT lines), for fsreplay */
+static FILE* trace;
+
+static struct timespec phase_start;
+
+/******************************************************************************/
+
+int
+disk_get_booting_drive(void)
+{
+    return BENCH_DRIVE;
+}
+
+bool_t
+disk_get_params(int drive, disk_params_t* params)
+{
+    memset(params, 0, sizeof(disk_params_t));
+
+    params->is_queried = true;
+    params->is_valid = (drive == BENCH_DRIVE);
+    params->bytes_per_sector = image_sector_size;
+    params->total_sectors = image_sectors;
+    params->edd_version = 0x30;
+
+    return params->is_valid;
+}
+
+bool_t
+disk_io(int mode, int drive_num, uint64_t sector_start, int sectors_to_transfer,
+    uint8_t* dst_buffer)
+{
+    size_t size = (size_t)sectors_to_transfer * image_sector_size;
+
+    if(drive_num != BENCH_DRIVE || sectors_to_transfer <= 0 ||
+        sector_start + sectors_to_transfer > image_sectors)
+    {
+        return false;
+    }
+
+    stats.requests++;
+    stats.sectors += sectors_to_transfer;
+
+    /*
+        split as disk.c does for a buffer in the real mode memory: at most
+        DISK_MAX_SECTORS_PER_IO sectors, no 64 KB boundary crossed, and a 
+        buffer with a sector across the boundary goes through the bounce
+        buffer. The host addresses stand in for the loader ones, the cache
+        aligns its stream line the same way on both.
+    */
+    uintptr_t addr = (uintptr_t)dst_buffer;
+    uint64_t sector = sector_start;
+    int left = sectors_to_transfer;
+
+    while(left > 0)
+    {
+        int count = left;
+
+        if(count > DISK_MAX_SECTORS_PER_IO)
+        {
+            count = DISK_MAX_SECTORS_PER_IO;
+        }
+
+        if((addr & 0xFFFF) + image_sector_size > 0x10000)
+        {
+            if(count > (int)(DISK_BOUNCE_BUFFER_SIZE / image_sector_size))
+            {
+                count = DISK_BOUNCE_BUFFER_SIZE / image_sector_size;
+            }
+        }
+        else
+        {
+            int max_count = (0x10000 - (addr & 0xFFFF)) / image_sector_size;
+
+            if(count > max_count)
+            {
+                count = max_count;
+            }
+        }
+
+        if(trace != NULL)
+        {
+            fprintf(trace, "DT %c %llx %d\n", (mode == READ ? 'R' : 'W'),
+                (unsigned long long)sector, count);
+        }
+
+        stats.bios_calls++;
+
+        sector += count;
+        left -= count;
+        addr += (uintptr_t)count * image_sector_size;
+    }
+
+    if(mode == READ)
+    {
+        memcpy(dst_buffer, image + sector_start * image_sector_size, size);
+    }
+    else
+    {
+        memcpy(image + sector_start * image_sector_size, dst_buffer, size);
+    }
+
+    return true;
+}
+
+/******************************************************************************/
+
+static void
+bench_begin(char* phase)
+{
+    memset(&stats, 0, sizeof(stats));
+
+    if(trace != NULL)
+    {
+        fprintf(trace, "# %s\n", phase);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
+}
+
+static void
+bench_end(char* phase)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* the requests between phases (mount, open) are set apart */
+    if(trace != NULL)
+    {
+        fprintf(trace, "# setup\n");
+    }
+
+    uint64_t usecs = (now.tv_sec - phase_start.tv_sec) * 1000000ULL +
+        (now.tv_nsec - phase_start.tv_nsec) / 1000;
+
+    printf("%-12s %8u requests %8u bios calls %10llu sectors %8llu us\n",
+        phase,
+        stats.requests,
+        stats.bios_calls,
+        (unsigned long long)stats.sectors,
+        (unsigned long long)usecs);
+}
+
+static bool_t
+bench_mount(FATFS* fs)
+{
+    if(pf_mount(fs) != FR_OK)
+    {
+        printf("[!] Failed to mount the volume\n");
+        return false;
+    }
+
+    return true;
+}
+
+static int
+bench_scan_dir(char* path, int depth)
+{
+    DIR dir;
+    FILINFO info;
+    char long_name[64];
+
+    int entries = 0;
+    size_t length = strlen(path);
+
+    info.lfname = long_name;
+    info.lfsize = sizeof(long_name);
+
+    if(pf_opendir(&dir, path) != FR_OK)
+    {
+        return 0;
+    }
+
+    while(pf_readdir(&dir, &info) == FR_OK && info.fname[0] != 0)
+    {
+        entries++;
+
+        /* walk the sub-directories too, a few levels down */
+        if((info.fattrib & AM_DIR) && info.fname[0] != '.' && depth < 4 &&
+            length + strlen(info.fname) + 2 < 256)
+        {
+            /* the root is "/", do not double the separator */
+            snprintf(path + length, 256 - length, 
+                (length == 1 && path[0] == '/') ? "%s" : "/%s", info.fname);
+
+            entries += bench_scan_dir(path, depth + 1);
+
+            path[length] = 0;
+        }
+    }
+
+    return entries;
+}
+
+static bool_t
+bench_find_file(char* name)
+{
+    DIR dir;
+    FILINFO info;
+
+    DWORD largest = 0;
+
+    info.lfname = NULL;
+    info.lfsize = 0;
+
+    /* no benchmark file, use the largest file of the root directory */
+    if(pf_opendir(&dir, "/") != FR_OK)
+    {
+        return false;
+    }
+
+    while(pf_readdir(&dir, &info) == FR_OK && info.fname[0] != 0)
+    {
+        if(!(info.fattrib & AM_DIR) && info.fsize > largest)
+        {
+            largest = info.fsize;
+            strcpy(name, info.fname);
+        }
+    }
+
+    return (largest != 0);
+}
+
+static UINT
+bench_stream_sum(void* ctx, const BYTE* data, UINT count)
+{
+    uint32_t* sum = (uint32_t *)ctx;
+
+    for(UINT i = 0; i < count; i++)
+    {
+        *sum = (*sum << 5) + *sum + data[i];
+    }
+
+    return count;
+}
+
+static void
+bench_run(char* name)
+{
+    FATFS fs;
+    FIL file;
+    UINT bytes_read;
+    char path[256];
+
+    uint8_t* buffer = (uint8_t *)malloc(BENCH_READ_SIZE);
+    uint32_t sum = 5381;
+
+    /* every phase starts from a fresh mount, so the cache is cold */
+    bench_begin("mount");
+
+    if(!bench_mount(&fs))
+    {
+        free(buffer);
+        return;
+    }
+
+    bench_end("mount");
+
+    bench_mount(&fs);
+    bench_begin("dir scan");
+
+    strcpy(path, "/");
+    int entries = bench_scan_dir(path, 0);
+
+    bench_end("dir scan");
+
+    if(name == NULL)
+    {
+        name = path;
+
+        if(pf_open(&file, BENCH_FILE) == FR_OK)
+        {
+            strcpy(name, BENCH_FILE);
+        }
+        else
+        if(!bench_find_file(name))
+        {
+            printf("[!] No file to read\n");
+            free(buffer);
+            return;
+        }
+    }
+
+    bench_mount(&fs);
+    bench_begin("open");
+
+    if(pf_open(&file, name) != FR_OK)
+    {
+        printf("[!] Failed to open %s\n", name);
+        free(buffer);
+        return;
+    }
+
+    bench_end("open");
+
+    bench_mount(&fs);
+    pf_open(&file, name);
+    bench_begin("sequential");
+
+    while(pf_read(&file, buffer, BENCH_READ_SIZE, &bytes_read) == FR_OK &&
+        bytes_read != 0);
+
+    bench_end("sequential");
+
+    bench_mount(&fs);
+    pf_open(&file, name);
+    bench_begin("stream");
+
+    pf_read_stream(&file, bench_stream_sum, &sum, file.fsize, &bytes_read);
+
+    bench_end("stream");
+
+    if(file.fsize >= BENCH_READ_SIZE)
+    {
+        uint32_t blocks = file.fsize / BENCH_READ_SIZE;
+        uint32_t seed = 0x12345678;
+
+        bench_mount(&fs);
+        pf_open(&file, name);
+        bench_begin("random");
+
+        /* same sequence as the loader benchmark */
+        for(int i = 0; i < BENCH_READS; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+
+            if(pf_lseek(&file, ((seed >> 8) % blocks) * BENCH_READ_SIZE) != FR_OK ||
+                pf_read(&file, buffer, BENCH_READ_SIZE, &bytes_read) != FR_OK)
+            {
+                printf("[!] Read failed\n");
+                break;
+            }
+        }
+
+        bench_end("random");
+    }
+
+    printf("\n%d directory entries, %s: %u bytes (sum %08X)\n",
+        entries, name, (uint32_t)file.fsize, sum);
+
+    free(buffer);
+}
+
+/******************************************************************************/
+
+int
+main(int argc, char* argv[])
+{
+    struct stat st;
+
+    int fd;
+    int opt;
+
+    char* trace_path = NULL;
+
+    while((opt = getopt(argc, argv, "t:")) != -1)
+    {
+        if(opt == 't')
+        {
+            trace_path = optarg;
+        }
+        else
+        {
+            /* unknown option, print the usage */
+            argc = optind;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if(argc < 1)
+    {
+        printf("RTFM: fsbench [-t trace] <image> [file] [sector size]\n");
+        return 0;
+    }
+
+    if(argc > 2)
+    {
+        image_sector_size = atoi(argv[2]);
+
+        if(image_sector_size < SECTOR_SIZE_DEFAULT ||
+            image_sector_size > SECTOR_SIZE_MAX ||
+            (image_sector_size & (image_sector_size - 1)) != 0)
+        {
+            printf("[!] Invalid sector size %s\n", argv[2]);
+            return 0;
+        }
+    }
+
+    if((fd = open(argv[0], O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+    {
+        printf("[!] Failed to open %s\n", argv[0]);
+        return 0;
+    }
+
+    /* private mapping, the writes of the file system stay in memory */
+    image = (uint8_t *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if(image == MAP_FAILED)
+    {
+        printf("[!] Failed to map %s\n", argv[0]);
+        return 0;
+    }
+
+    if(trace_path != NULL && (trace = fopen(trace_path, "w")) == NULL)
+    {
+        printf("[!] Failed to create %s\n", trace_path);
+        munmap(image, st.st_size);
+        return 0;
+    }
+
+    image_sectors = st.st_size / image_sector_size;
+
+    bench_run(argc > 1 ? argv[1] : NULL);
+
+    if(trace != NULL)
+    {
+        fclose(trace);
+    }
+
+    munmap(image, st.st_size);
+
+    return 0;
+}
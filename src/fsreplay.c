@@ -0,0 +1,280 @@
+﻿
+/*
+
+    This file is part of x86_vbrkit.
+
+    Copyright 2017 / the`janitor / < email: base64dec(dGhlLmphbml0b3JAcHJvdG9ubWFpbC5jb20=) >
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "types.h"
+#include "disk.h"
+
+/*
+    Replays a disk trace (DT lines, see disk.h) from fsbench -t or from
+    the serial log of a TRACE=1 loader, and scores every section under a few
+    cost models: a fixed cost per BIOS call plus a cost per sector. Both 
+    traces are recorded after the 64 KB boundary and bounce buffer splits, 
+    one line per call; a model with a smaller max sectors splits them further
+*/
+#define REPLAY_MAX_MODELS       8
+#define REPLAY_MAX_SECTIONS     64
+#define REPLAY_NAME_SIZE        32
+
+typedef struct
+{
+    char        name[REPLAY_NAME_SIZE];
+    double      call_us;
+    double      sector_us;
+    uint32_t    max_sectors;
+
+} replay_model_t;
+
+typedef struct
+{
+    char        name[REPLAY_NAME_SIZE];
+    uint32_t    requests;
+    uint32_t    writes;
+    uint64_t    sectors;
+    uint64_t    calls[REPLAY_MAX_MODELS];
+    double      cost_us[REPLAY_MAX_MODELS];
+
+} replay_section_t;
+
+/******************************************************************************/
+
+/* used when no model is given */
+static replay_model_t default_models[] =
+{
+    { "emulated",   30.0,   1.0,    DISK_MAX_SECTORS_PER_IO },
+    { "hdd",        500.0,  4.0,    DISK_MAX_SECTORS_PER_IO },
+    { "usb",        1000.0, 25.0,   DISK_MAX_SECTORS_PER_IO },
+};
+
+static replay_model_t models[REPLAY_MAX_MODELS];
+static int models_count;
+
+static replay_section_t sections[REPLAY_MAX_SECTIONS + 1];
+static int sections_count;
+
+/******************************************************************************/
+
+static bool_t
+replay_parse_model(char* arg, replay_model_t* model)
+{
+    char* spec = strchr(arg, '=');
+    int length;
+
+    /* name=call_us:sector_us[:max_sectors] */
+    if(spec == NULL || (length = spec - arg) == 0 || length >= REPLAY_NAME_SIZE)
+    {
+        return false;
+    }
+
+    memcpy(model->name, arg, length);
+    model->name[length] = 0;
+
+    model->max_sectors = DISK_MAX_SECTORS_PER_IO;
+
+    int fields = sscanf(spec + 1, "%lf:%lf:%u", &model->call_us, 
+        &model->sector_us, &model->max_sectors);
+
+    return (fields >= 2 && model->max_sectors != 0);
+}
+
+static replay_section_t*
+replay_section(char* name)
+{
+    replay_section_t* section;
+
+    /* sections with the same name add up */
+    for(int i = 0; i < sections_count; i++)
+    {
+        if(strncmp(sections[i].name, name, REPLAY_NAME_SIZE - 1) == 0)
+        {
+            return &sections[i];
+        }
+    }
+
+    /* the last slot collects everything past the limit */
+    if(sections_count == REPLAY_MAX_SECTIONS)
+    {
+        section = &sections[REPLAY_MAX_SECTIONS];
+        strcpy(section->name, "(more)");
+
+        return section;
+    }
+
+    section = &sections[sections_count++];
+
+    strncpy(section->name, name, REPLAY_NAME_SIZE - 1);
+
+    return section;
+}
+
+static void
+replay_request(replay_section_t* section, char mode, uint32_t sectors)
+{
+    section->requests++;
+    section->sectors += sectors;
+
+    if(mode == 'W')
+    {
+        section->writes++;
+    }
+
+    for(int i = 0; i < models_count; i++)
+    {
+        replay_model_t* model = &models[i];
+
+        uint32_t calls = (sectors + model->max_sectors - 1) / model->max_sectors;
+
+        section->calls[i] += calls;
+        section->cost_us[i] += calls * model->call_us + 
+            sectors * model->sector_us;
+    }
+}
+
+static void
+replay_print(replay_section_t* section)
+{
+    printf("%-16s %8u %8u %10llu", 
+        section->name, 
+        section->requests, 
+        section->writes, 
+        (unsigned long long)section->sectors);
+
+    for(int i = 0; i < models_count; i++)
+    {
+        printf(" %8llu %10.2f", 
+            (unsigned long long)section->calls[i], 
+            section->cost_us[i] / 1000.0);
+    }
+
+    printf("\n");
+}
+
+/******************************************************************************/
+
+int
+main(int argc, char* argv[])
+{
+    FILE* file;
+    char line[256];
+    char label[16];
+
+    replay_section_t total;
+    replay_section_t* section = NULL;
+
+    if(argc < 2)
+    {
+        printf("RTFM: fsreplay <trace> [name=call_us:sector_us[:max_sectors]] ...\n");
+        return 0;
+    }
+
+    for(int i = 2; i < argc && models_count < REPLAY_MAX_MODELS; i++)
+    {
+        if(!replay_parse_model(argv[i], &models[models_count]))
+        {
+            printf("[!] Invalid cost model %s\n", argv[i]);
+            return 0;
+        }
+
+        models_count++;
+    }
+
+    if(models_count == 0)
+    {
+        models_count = sizeof(default_models) / sizeof(default_models[0]);
+        memcpy(models, default_models, sizeof(default_models));
+    }
+
+    if((file = fopen(argv[1], "r")) == NULL)
+    {
+        printf("[!] Failed to open %s\n", argv[1]);
+        return 0;
+    }
+
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        char mode;
+        unsigned long long sector_start;
+        unsigned int sectors;
+
+        /* serial logs come with CR LF */
+        line[strcspn(line, "\r\n")] = 0;
+
+        if(line[0] == '#' && line[1] == ' ')
+        {
+            section = replay_section(line + 2);
+        }
+        else
+        if(sscanf(line, "DT %c %llx %u", &mode, &sector_start, &sectors) == 3 &&
+            (mode == 'R' || mode == 'W'))
+        {
+            if(section == NULL)
+            {
+                section = replay_section("-");
+            }
+
+            replay_request(section, mode, sectors);
+        }
+    }
+
+    fclose(file);
+
+    /* header, one column pair per model */
+    printf("%-16s %8s %8s %10s", "section", "requests", "writes", "sectors");
+
+    for(int i = 0; i < models_count; i++)
+    {
+        snprintf(label, sizeof(label), "%.7s ms", models[i].name);
+        printf(" %8s %10s", "calls", label);
+    }
+
+    printf("\n");
+
+    memset(&total, 0, sizeof(total));
+    strcpy(total.name, "total");
+
+    for(int i = 0; i <= REPLAY_MAX_SECTIONS; i++)
+    {
+        section = &sections[i];
+
+        if(section->requests == 0)
+        {
+            continue;
+        }
+
+        replay_print(section);
+
+        total.requests += section->requests;
+        total.writes += section->writes;
+        total.sectors += section->sectors;
+
+        for(int j = 0; j < models_count; j++)
+        {
+            total.calls[j] += section->calls[j];
+            total.cost_us[j] += section->cost_us[j];
+        }
+    }
+
+    replay_print(&total);
+
+    return 0;
+}
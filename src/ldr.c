@@ -24,6 +24,7 @@
 #include <disk.h>
 #include <mem.h>
 #include <video.h>
+#include <mtrr.h>
 #include <types.h>
 #include <pff.h>
 #include <pe.h>
@@ -275,6 +276,9 @@ ldr_isr_rm_callback(void* p)
         uint8_t* buffer;
         uint16_t sectors;
 
+        /* drive number (DL), preserved by the services below */
+        int drive = isr_ctx->saved_regs.edx & 0xFF;
+
         if((((isr_ctx->ax) >> 8) & 0xFF) == BIOS_SVC_DISK_READ && !(isr_ctx->efl & 1))
         {
             buffer = (uint8_t *)(((uint32_t)(isr_ctx->es) << 4) + 
@@ -289,8 +293,18 @@ ldr_isr_rm_callback(void* p)
         {
             buffer = (uint8_t *)(((uint32_t)dap->dst_seg << 4) + dap->dst_offs);
 
-            /* assuming sector size is 512 bytes */
-            uint32_t size = dap->sectors_to_transfer * 512;
+            /* EDD 3.0 64-bit flat address */
+            if(dap->packet_size >= sizeof(dap_t) && 
+                dap->dst_seg == 0xFFFF && dap->dst_offs == 0xFFFF)
+            {
+                buffer = (uint8_t *)(uint32_t)dap->dst_flat;
+            }
+
+            /* 
+                sector size as reported by INT 13H / AH=48H for the drive, 
+                if already queried: a query from the hook would nest INT 13h
+            */
+            uint32_t size = dap->sectors_to_transfer * disk_get_cached_sector_size(drive);
 
 #if _DEBUG
 
@@ -316,6 +330,15 @@ ldr_isr_rm_callback(void* p)
             */
         }
         else
+        if((((isr_ctx->ax) >> 8) & 0xFF) == BIOS_SVC_DISK_EXTENDED_GET_PARAMS && !(isr_ctx->efl & 1))
+        {
+            /* 
+                keep track of the geometry reported to the caller, so that 
+                no additional BIOS calls are needed from within the hook
+            */
+            disk_update_params(drive, (edd_params_t *)dap);
+        }
+        else
         {
             /* nothing */
         }
@@ -348,12 +371,25 @@ print_root_directory()
     {
         FILINFO file_info;
         char    file_name[16];
+        char    long_name[64];
+
+        file_info.lfname = long_name;
+        file_info.lfsize = sizeof(long_name);
 
         while(pf_readdir(&dir, &file_info) == FR_OK && file_info.fname[0] != 0)
         {
             memset(file_name, 0, sizeof(file_name));
             memcpy(file_name, file_info.fname, sizeof(file_info.fname));
 
+            /* prefer the long file name, if there is one */
+            if(long_name[0] != 0)
+            {
+                printf(FG_WHITE, "/%s (%d bytes) (%s)\n", long_name, file_info.fsize,
+                    ((file_info.fattrib & AM_DIR) ? "folder" : "file"));
+
+                continue;
+            }
+
             /* print the file info */
             printf(FG_WHITE, "/%s (%d bytes) (%s)\n", file_name, file_info.fsize,
                 ((file_info.fattrib & AM_DIR) ? "folder" : "file"));
@@ -367,6 +403,130 @@ print_root_directory()
 
 /******************************************************************************/
 
+#ifdef _BENCH
+
+#define BENCH_FILE          "bench.bin"
+#define BENCH_READ_SIZE     0x1000
+#define BENCH_READS         1000
+
+/* random 4 KB reads over a large file, exercises pf_lseek */
+static void
+bench_random_reads()
+{
+    FATFS fs;
+    FIL file;
+    UINT bytes_read;
+
+    uint8_t* buffer = (uint8_t *)malloc(BENCH_READ_SIZE);
+
+    if(buffer == NULL)
+    {
+        return;
+    }
+
+    if(pf_mount(&fs) != FR_OK || pf_open(&file, BENCH_FILE) != FR_OK || 
+        file.fsize < BENCH_READ_SIZE)
+    {
+        printf(FG_LRED, "> bench: failed to open %s\n", BENCH_FILE);
+
+        free(buffer);
+        return;
+    }
+
+    uint32_t blocks = file.fsize / BENCH_READ_SIZE;
+    uint32_t seed = 0x12345678;
+
+    uint64_t start = rdtsc();
+
+    for(int i = 0; i < BENCH_READS; i++)
+    {
+        /* fixed seed, the runs are comparable */
+        seed = seed * 1103515245 + 12345;
+
+        if(pf_lseek(&file, ((seed >> 8) % blocks) * BENCH_READ_SIZE) != FR_OK ||
+            pf_read(&file, buffer, BENCH_READ_SIZE, &bytes_read) != FR_OK)
+        {
+            printf(FG_LRED, "> bench: read failed\n");
+            break;
+        }
+    }
+
+    uint32_t kcycles = (uint32_t)((rdtsc() - start) >> 10);
+
+    printf(FG_WHITE, "> bench: %d random reads of %d bytes, %d kcycles per read\n", 
+        BENCH_READS, BENCH_READ_SIZE, kcycles / BENCH_READS);
+
+    free(buffer);
+}
+
+#define BENCH_FRAMES        16
+
+static uint32_t
+bench_blit_frames(bmp_t* frame)
+{
+    uint64_t start = rdtsc();
+
+    for(int i = 0; i < BENCH_FRAMES; i++)
+    {
+        bmp_to_framebuffer(frame);
+    }
+
+    return (uint32_t)((rdtsc() - start) >> 10) / BENCH_FRAMES;
+}
+
+/* full frame copies to the LFB, with the firmware memory type and then WC */
+static void
+bench_framebuffer()
+{
+    vesa_pixel_fmt_t* fmt = vesa_get_pixel_fmt();
+    bmp_t frame;
+    uint8_t* pixels;
+
+    if(fmt->lfb == NULL && !vesa_set_mode(800, 600, 32))
+    {
+        printf(FG_LRED, "> bench: no linear frame buffer\n");
+        return;
+    }
+
+    pixels = (uint8_t *)mem_high_alloc(fmt->width * fmt->height * fmt->pixel_size);
+
+    if(pixels == NULL)
+    {
+        printf(FG_LRED, "> bench: no memory for a %dx%d frame\n", 
+            fmt->width, fmt->height);
+        return;
+    }
+
+    bmp_init(&frame, fmt->width, fmt->height, fmt->bpp, pixels);
+
+    bmp_rect(&frame, 0, 0, frame.width, frame.height, 0x204060);
+
+    /* WC=1 builds map the frame buffer when the mode is set */
+    mtrr_restore();
+
+    uint32_t before = bench_blit_frames(&frame);
+    bool_t wc = vesa_set_lfb_wc();
+    uint32_t after = bench_blit_frames(&frame);
+
+#ifndef _VIDEO_WC
+
+    mtrr_restore();
+
+#endif
+
+    /* the console contents, if it draws on the frame buffer */
+    video_mark_dirty(0, 0, fmt->width, fmt->height);
+    video_present();
+
+    printf(FG_WHITE, "> bench: %dx%dx%d frame blit, %d kcycles before, %d kcycles %s\n", 
+        fmt->width, fmt->height, fmt->bpp, before, after, 
+        (wc ? "write-combining" : "(no WC range)"));
+}
+
+#endif
+
+/******************************************************************************/
+
 void
 ldr_main(int boot_drive)
 {
@@ -394,6 +554,13 @@ ldr_main(int boot_drive)
     print_serial_ports();
     print_mmap();
 
+#endif
+
+#ifdef _BENCH
+
+    bench_random_reads();
+    bench_framebuffer();
+
 #endif
 
     /* find another bootable drive to boot from */
@@ -408,8 +575,21 @@ ldr_main(int boot_drive)
 
     printf(FG_WHITE, "> Next drive to boot: %xh\n", drive_to_boot);
 
+    /* query (and cache) the geometry now, the disk hooks rely on it */
+    disk_get_sector_size(drive_to_boot);
+
+#ifdef _TRACE
+
+    /* every disk request made so far, for fsreplay */
+    disk_trace_dump(SERIAL_PORT1);
+
+#endif
+
     getch();
 
+    /* the firmware memory types for the next stage */
+    mtrr_restore();
+
     /* load the first sector and jump to it */
     if(disk_io(READ, drive_to_boot, 0, 1, (uint8_t *)0x7C00))
     {
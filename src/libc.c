@@ -25,6 +25,11 @@
 
 /******************************************************************************/
 
+/* unknown (-1) until the first memset32() */
+static int8_t libc_sse2 = -1;
+
+/******************************************************************************/
+
 void 
 __sidt(idt_t* dst)
 {
@@ -55,6 +60,49 @@ __cr0()
     return val;
 }
 
+void
+__set_cr0(uint32_t value)
+{
+    __asm__ __volatile__ ( "mov %0, %%cr0" : : "r"(value) : "memory" );
+}
+
+uint64_t
+__rdmsr(uint64_t msr)
+{
+    uint32_t eax;
+    uint32_t edx;
+
+    __asm__ __volatile__ (
+        "rdmsr;"
+        : /* output operands */
+        "=a" (eax),
+        "=d" (edx)
+        : /* input operands */
+        "c" ((uint32_t)msr) );
+
+    return (uint64_t)eax | (uint64_t)edx << 32;
+}
+
+void
+__wrmsr(uint64_t msr, uint64_t value)
+{
+    __asm__ __volatile__ (
+        "wrmsr;"
+        : /* output operands - none */
+        : /* input operands */
+        "c" ((uint32_t)msr),
+        "a" ((uint32_t)value),
+        "d" ((uint32_t)(value >> 32))
+        : /* clobbers */
+        "memory" );
+}
+
+void
+__wbinvd(void)
+{
+    __asm__ __volatile__ ( "wbinvd" : : : "memory" );
+}
+
 uint16_t 
 __cs()
 {
@@ -65,6 +113,21 @@ __cs()
     return seg;
 }
 
+void
+__cpuid(uint32_t leaf, uint32_t* regs)
+{
+    __asm__ __volatile__ (
+        "cpuid;"
+        : /* output operands */
+        "=a" (regs[0]),
+        "=b" (regs[1]),
+        "=c" (regs[2]),
+        "=d" (regs[3])
+        : /* input operands */
+        "a" (leaf),
+        "c" (0) );
+}
+
 /******************************************************************************/
 
 static void
@@ -73,11 +136,11 @@ __movsb(void* dst, void* src, size_t size)
     __asm__ volatile (
         "cld;"
         "rep movsb;"
-        : /* output operands - none */
-        : /* input operands */
-        "D" (dst),  /* edi/di */
-        "S" (src),  /* esi/si */
-        "c" (size)  /* ecx/cx/cl */
+        : /* output operands, the registers are consumed */
+        "+D" (dst), /* edi/di */
+        "+S" (src), /* esi/si */
+        "+c" (size) /* ecx/cx/cl */
+        : /* input operands - none */
         : /* clobbers */
         "memory" );
 }
@@ -88,11 +151,11 @@ __movsd(void* dst, void* src, size_t size)
     __asm__ volatile (
         "cld;"
         "rep movsd;"
-        : /* output operands - none */
-        : /* input operands */
-        "D" (dst),  /* edi/di */
-        "S" (src),  /* esi/si */
-        "c" (size)  /* ecx/cx/cl */
+        : /* output operands, the registers are consumed */
+        "+D" (dst), /* edi/di */
+        "+S" (src), /* esi/si */
+        "+c" (size) /* ecx/cx/cl */
+        : /* input operands - none */
         : /* clobbers */
         "memory" );
 }
@@ -103,11 +166,11 @@ __stosb(void* dst, uint8_t data, size_t size)
     __asm__ volatile (
         "cld;"
         "rep stosb;"
-        : /* output operands - none */
+        : /* output operands, the registers are consumed */
+        "+D" (dst), /* edi/di */
+        "+c" (size) /* ecx/cx/cl */
         : /* input operands */
-        "D" (dst),  /* edi/di */
-        "a" (data), /* eax/ax/al */
-        "c" (size)  /* ecx/cx/cl */
+        "a" (data)  /* eax/ax/al */
         : /* clobbers */
         "memory" );
 }
@@ -118,15 +181,40 @@ __stosd(void* dst, uint32_t data, size_t size)
     __asm__ volatile (
         "cld;"
         "rep stosl;"
-        : /* output operands - none */
+        : /* output operands, the registers are consumed */
+        "+D" (dst), /* edi/di */
+        "+c" (size) /* ecx/cx/cl */
         : /* input operands */
-        "D" (dst),  /* edi/di */
-        "a" (data), /* eax/ax/al */
-        "c" (size)  /* ecx/cx/cl */
+        "a" (data)  /* eax/ax/al */
         : /* clobbers */
         "memory" );
 }
 
+/* xmm0 is only known to the compiler with SSE2 code generation */
+static void __attribute__((target("sse2")))
+__stosdq(void* dst, uint32_t data, size_t size)
+{
+    /* 64 bytes per iteration, dst aligned to 16 bytes */
+    __asm__ volatile (
+        "movd %2, %%xmm0;"
+        "pshufd $0, %%xmm0, %%xmm0;"
+        "1:"
+        "movdqa %%xmm0, 0(%0);"
+        "movdqa %%xmm0, 16(%0);"
+        "movdqa %%xmm0, 32(%0);"
+        "movdqa %%xmm0, 48(%0);"
+        "add $64, %0;"
+        "dec %1;"
+        "jnz 1b;"
+        : /* output operands, the registers are consumed */
+        "+r" (dst),
+        "+r" (size)
+        : /* input operands */
+        "r" (data)
+        : /* clobbers */
+        "xmm0", "memory" );
+}
+
 static uint8_t
 actohex(char c)
 {
@@ -229,15 +317,33 @@ rdtsc(void)
 void
 memcpy(void* dst, void* src, size_t size)
 {
-    if(!(size & 3))
+    /* dwords first, then the remaining bytes */
+    __movsd(dst, src, size >> 2);
+
+    if(size & 3)
     {
-        /* if size is a multiple of 4 */
-        __movsd(dst, src, size >> 2);
+        __movsb((uint8_t *)dst + (size & ~3), (uint8_t *)src + (size & ~3), 
+            size & 3);
     }
-    else
+}
+
+void
+memmove(void* dst, void* src, size_t size)
+{
+    uint8_t* d = (uint8_t *)dst;
+    uint8_t* s = (uint8_t *)src;
+
+    /* a forward copy is safe unless dst overlaps the end of src */
+    if(d <= s || d >= s + size)
     {
-        /* move byte-by-byte */
-        __movsb(dst, src, size);
+        memcpy(dst, src, size);
+        return;
+    }
+
+    while(size != 0)
+    {
+        size--;
+        d[size] = s[size];
     }
 }
 
@@ -277,6 +383,37 @@ memset(void* dst, uint32_t data, size_t size)
 #endif
 }
 
+void
+memset32(void* dst, uint32_t data, size_t count)
+{
+    uint32_t regs[4];
+
+    /* SSE (OSFXSR) is enabled by ldr.asm, SSE2 is CPUID.1:EDX[26] */
+    if(libc_sse2 < 0)
+    {
+        __cpuid(1, regs);
+        libc_sse2 = (regs[3] >> 26) & 1;
+    }
+
+    /* dwords up to a 16 bytes boundary, then 64 bytes blocks */
+    if(libc_sse2 && count >= 32 && !((uint32_t)dst & 3))
+    {
+        size_t head = ((16 - ((uint32_t)dst & 15)) & 15) >> 2;
+
+        __stosd(dst, data, head);
+
+        dst = (uint32_t *)dst + head;
+        count -= head;
+
+        __stosdq(dst, data, count >> 4);
+
+        dst = (uint32_t *)dst + (count & ~15);
+        count &= 15;
+    }
+
+    __stosd(dst, data, count);
+}
+
 int
 memcmp(void* a, void* b, size_t n)
 {
@@ -31,6 +31,9 @@ static size_t       mem_size = 0;
 static size_t       mem_allocated;
 static uint32_t     mem_newly_freed_count;
 
+/* next free byte of the high memory */
+static uint32_t     mem_high_next = MEM_HIGH_BASE;
+
 /******************************************************************************/
 
 void
@@ -226,3 +229,24 @@ free(void* mem)
     /* merge free blocks */
     malloc_merge_free_blks();
 }
+
+void*
+mem_high_alloc(size_t size)
+{
+    uint8_t* mem = (uint8_t *)mem_high_next;
+
+    /* page aligned blocks, for buffers too big for the real mode memory */
+    size = (size + MEM_HIGH_ALIGN - 1) & ~(MEM_HIGH_ALIGN - 1);
+
+    if(size == 0 || size > MEM_HIGH_END - mem_high_next)
+    {
+        return NULL;
+    }
+
+    mem_high_next += size;
+
+    /* zero out the allocated memory */
+    memset(mem, 0, size);
+
+    return (void *)mem;
+}
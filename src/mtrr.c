@@ -0,0 +1,228 @@
+/*
+
+    This file is part of x86_vbrkit.
+
+    Copyright 2017 / the`janitor / < email: base64dec(dGhlLmphbml0b3JAcHJvdG9ubWFpbC5jb20=) >
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+
+*/
+#include <shared.h>
+#include <libc.h>
+#include <mtrr.h>
+#include <types.h>
+
+/******************************************************************************/
+
+/* 
+    the ranges as set up by the firmware, for mtrr_restore(), the count is 
+    -1 while nothing is changed
+*/
+static mtrr_range_t mtrr_saved[MTRR_MAX_CHANGES];
+static int mtrr_saved_count = -1;
+
+static uint32_t mtrr_cr0;
+static uint64_t mtrr_def_type;
+
+/******************************************************************************/
+
+static uint64_t
+mtrr_phys_mask(void)
+{
+    uint32_t regs[4];
+    uint32_t bits = 36;
+
+    /* physical address width, 36 bits if not reported */
+    __cpuid(0x80000000, regs);
+
+    if(regs[0] >= 0x80000008)
+    {
+        __cpuid(0x80000008, regs);
+        bits = regs[0] & 0xFF;
+    }
+
+    return ((1ULL << bits) - 1) & ~(uint64_t)(MTRR_PAGE_SIZE - 1);
+}
+
+static void
+mtrr_begin(void)
+{
+    mtrr_cr0 = __cr0();
+    mtrr_def_type = __rdmsr(MSR_MTRR_DEF_TYPE);
+
+    /* 
+        Intel SDM Vol. 3A, 11.11.7.2: no-fill cache mode and flush, MTRRs
+        disabled while the ranges change (no interrupts, no IDT)
+    */
+    __set_cr0((mtrr_cr0 | CR0_CD) & ~CR0_NW);
+    __wbinvd();
+    __wrmsr(MSR_MTRR_DEF_TYPE, mtrr_def_type & ~(uint64_t)MTRR_DEF_TYPE_ENABLE);
+}
+
+static void
+mtrr_end(void)
+{
+    __wbinvd();
+    __wrmsr(MSR_MTRR_DEF_TYPE, mtrr_def_type);
+    __set_cr0(mtrr_cr0);
+}
+
+static void
+mtrr_write(int index, uint64_t base, uint64_t mask)
+{
+    mtrr_range_t* saved = &mtrr_saved[mtrr_saved_count++];
+
+    saved->index = index;
+    saved->base = __rdmsr(MSR_MTRR_PHYS_BASE(index));
+    saved->mask = __rdmsr(MSR_MTRR_PHYS_MASK(index));
+
+    __wrmsr(MSR_MTRR_PHYS_BASE(index), base);
+    __wrmsr(MSR_MTRR_PHYS_MASK(index), mask);
+}
+
+bool_t
+mtrr_set_wc(uint32_t base, uint32_t size)
+{
+    uint32_t regs[4];
+    uint32_t range = MTRR_PAGE_SIZE;
+
+    int free_ranges[MTRR_MAX_CHANGES];
+    int free_count = 0;
+
+    int uc_index = -1;
+    uint64_t uc_base = 0;
+    uint64_t uc_size = 0;
+
+    if(mtrr_saved_count >= 0 || size == 0 || size > 0x80000000)
+        return false;
+
+    __cpuid(1, regs);
+
+    if(!(regs[3] & CPUID_FEATURE_MTRR))
+        return false;
+
+    uint64_t cap = __rdmsr(MSR_MTRR_CAP);
+
+    if(!(cap & MTRR_CAP_WC))
+        return false;
+
+    /* a variable range is a power of 2, aligned on its size */
+    while(range < size)
+    {
+        range <<= 1;
+    }
+
+    if(base & (range - 1))
+        return false;
+
+    uint64_t phys_mask = mtrr_phys_mask();
+    uint64_t mask = ~(uint64_t)(range - 1) & phys_mask;
+
+    for(int i = 0; i < (cap & MTRR_CAP_VCNT); i++)
+    {
+        uint64_t other_base = __rdmsr(MSR_MTRR_PHYS_BASE(i));
+        uint64_t other_mask = __rdmsr(MSR_MTRR_PHYS_MASK(i));
+
+        if(!(other_mask & MTRR_PHYS_MASK_VALID))
+        {
+            if(free_count < MTRR_MAX_CHANGES)
+                free_ranges[free_count++] = i;
+
+            continue;
+        }
+
+        other_mask &= phys_mask;
+
+        /* UC wins where ranges overlap, a UC range holding the LFB is split */
+        if((other_base & 0xFF) == MTRR_TYPE_UC &&
+            ((other_base ^ base) & other_mask & mask) == 0)
+        {
+            uint64_t other_size = (~other_mask & phys_mask) + MTRR_PAGE_SIZE;
+
+            if(uc_index >= 0 || other_size < range || other_size > 0x100000000ULL)
+                return false;
+
+            uc_index = i;
+            uc_base = other_base & other_mask;
+            uc_size = other_size;
+        }
+    }
+
+    /* one UC range per halving down to the LFB, the first one in its place */
+    int needed = 1;
+
+    for(uint64_t half = uc_size >> 1; half >= range; half >>= 1)
+    {
+        needed++;
+    }
+
+    if(uc_index >= 0)
+        needed--;
+
+    if(free_count < needed || needed >= MTRR_MAX_CHANGES)
+        return false;
+
+    mtrr_saved_count = 0;
+
+    mtrr_begin();
+
+    if(uc_index >= 0)
+    {
+        int next = uc_index;
+
+        /* the UC halves that do not hold the LFB, it gets the last one */
+        for(uint64_t half = uc_size >> 1; half >= range; half >>= 1)
+        {
+            uint64_t other = uc_base + ((base & half) ? 0 : half);
+
+            if(base & half)
+                uc_base += half;
+
+            mtrr_write(next, other | MTRR_TYPE_UC, 
+                (~(half - 1) & phys_mask) | MTRR_PHYS_MASK_VALID);
+
+            next = free_ranges[--free_count];
+        }
+
+        free_ranges[free_count++] = next;
+    }
+
+    mtrr_write(free_ranges[--free_count], base | MTRR_TYPE_WC, 
+        mask | MTRR_PHYS_MASK_VALID);
+
+    mtrr_end();
+
+    return true;
+}
+
+void
+mtrr_restore(void)
+{
+    /* the next stage gets the ranges set up by the firmware */
+    if(mtrr_saved_count < 0)
+        return;
+
+    mtrr_begin();
+
+    while(mtrr_saved_count > 0)
+    {
+        mtrr_range_t* saved = &mtrr_saved[--mtrr_saved_count];
+
+        __wrmsr(MSR_MTRR_PHYS_BASE(saved->index), saved->base);
+        __wrmsr(MSR_MTRR_PHYS_MASK(saved->index), saved->mask);
+    }
+
+    mtrr_end();
+
+    mtrr_saved_count = -1;
+}
@@ -25,12 +25,243 @@
 #include <types.h>
 #include <stdarg.h>
 #include <bios.h>
+#include <pff.h>
+#include <mtrr.h>
 
 /******************************************************************************/
 
 static vbe_info_t* vbe_info;
 static vesa_mode_info_t* vesa_mode_info;
 
+/* usable modes, enumerated once */
+static vesa_mode_t* vesa_modes;
+static int vesa_modes_count;
+static bool_t vesa_modes_queried;
+
+/* the pointers above are valid once set (1) */
+static int8_t vesa_initialized = -1;
+
+static uint32_t vesa_pack_generic(uint32_t rgb);
+static uint32_t vesa_unpack_generic(uint32_t pixel);
+static void vesa_store_none(uint8_t* ptr, uint32_t pixel);
+static uint32_t vesa_load_none(uint8_t* ptr);
+
+/* 
+    back buffer in high memory, in the format of the mode, and the dirty 
+    span of each of its rows: video_present() copies only those to the 
+    frame buffer (uncached MMIO)
+*/
+static bmp_t video_back;
+static uint32_t video_back_size = 0;
+static video_span_t* video_spans;
+static uint32_t video_dirty_top;
+static uint32_t video_dirty_bottom; /* past the last dirty row */
+
+/* expanded glyphs, the color pairs in use most recently */
+static glyph_cache_t glyph_caches[GLYPH_CACHE_SLOTS];
+static uint32_t glyph_cache_uses;
+
+/* no mode set yet, the pixels stay black */
+static vesa_pixel_fmt_t vesa_fmt = 
+{
+    .pack = vesa_pack_generic,
+    .unpack = vesa_unpack_generic,
+    .store = vesa_store_none,
+    .load = vesa_load_none
+};
+
+/******************************************************************************/
+
+static uint32_t
+vesa_pack_generic(uint32_t rgb)
+{
+    return 
+        (((rgb >> 16) & vesa_fmt.red_mask) << vesa_fmt.red_shift) |
+        (((rgb >> 8) & vesa_fmt.green_mask) << vesa_fmt.green_shift) |
+        ((rgb & vesa_fmt.blue_mask) << vesa_fmt.blue_shift);
+}
+
+static uint32_t
+vesa_unpack_generic(uint32_t pixel)
+{
+    return 
+        ((pixel >> vesa_fmt.red_shift) & vesa_fmt.red_mask) << 16 |
+        ((pixel >> vesa_fmt.green_shift) & vesa_fmt.green_mask) << 8 |
+        ((pixel >> vesa_fmt.blue_shift) & vesa_fmt.blue_mask);
+}
+
+static uint32_t
+vesa_pack_rgb888(uint32_t rgb)
+{
+    /* 8:8:8 at 16:8:0, the packed pixel is the color itself */
+    return rgb & 0xFFFFFF;
+}
+
+static uint32_t
+vesa_pack_rgb565(uint32_t rgb)
+{
+    /* 5:6:5 at 11:5:0, keeps the low bits of each channel */
+    return ((rgb >> 5) & 0xF800) | ((rgb >> 3) & 0x07E0) | (rgb & 0x001F);
+}
+
+static uint32_t
+vesa_unpack_rgb565(uint32_t pixel)
+{
+    return ((pixel << 5) & 0x1F0000) | ((pixel << 3) & 0x3F00) | (pixel & 0x1F);
+}
+
+static void
+vesa_store_none(uint8_t* ptr, uint32_t pixel)
+{
+    /* unsupported pixel size */
+}
+
+static void
+vesa_store_8(uint8_t* ptr, uint32_t pixel)
+{
+    *(uint8_t *)ptr = pixel;
+}
+
+static void
+vesa_store_16(uint8_t* ptr, uint32_t pixel)
+{
+    *(uint16_t *)ptr = pixel;
+}
+
+static void
+vesa_store_32(uint8_t* ptr, uint32_t pixel)
+{
+    *(uint32_t *)ptr = pixel;
+}
+
+static uint32_t
+vesa_load_none(uint8_t* ptr)
+{
+    return 0;
+}
+
+static uint32_t
+vesa_load_8(uint8_t* ptr)
+{
+    return *(uint8_t *)ptr;
+}
+
+static uint32_t
+vesa_load_16(uint8_t* ptr)
+{
+    return *(uint16_t *)ptr;
+}
+
+static uint32_t
+vesa_load_32(uint8_t* ptr)
+{
+    return *(uint32_t *)ptr;
+}
+
+static void
+(*vesa_get_store(uint8_t bpp))(uint8_t*, uint32_t)
+{
+    if(bpp == 32)
+        return vesa_store_32;
+
+    if(bpp == 16)
+        return vesa_store_16;
+
+    if(bpp == 8)
+        return vesa_store_8;
+
+    return vesa_store_none;
+}
+
+static uint32_t
+(*vesa_get_load(uint8_t bpp))(uint8_t*)
+{
+    if(bpp == 32)
+        return vesa_load_32;
+
+    if(bpp == 16)
+        return vesa_load_16;
+
+    if(bpp == 8)
+        return vesa_load_8;
+
+    return vesa_load_none;
+}
+
+static uint8_t
+vesa_channel_mask(uint8_t size)
+{
+    return (size >= 8) ? 0xFF : (1 << size) - 1;
+}
+
+static void
+vesa_compile_pixel_fmt(vesa_mode_t* mode)
+{
+    vesa_pixel_fmt_t* fmt = &vesa_fmt;
+
+    fmt->lfb = (uint8_t *)mode->lfb;
+
+    if(fmt->lfb == (uint8_t *)(~0))
+        fmt->lfb = NULL;
+
+    fmt->pitch = mode->pitch;
+    fmt->width = mode->width;
+    fmt->height = mode->height;
+    fmt->bpp = mode->bpp;
+    fmt->pixel_size = mode->bpp >> 3;
+
+    fmt->red_shift = mode->red_mask_pos;
+    fmt->green_shift = mode->green_mask_pos;
+    fmt->blue_shift = mode->blue_mask_pos;
+
+    fmt->red_mask = vesa_channel_mask(mode->red_mask_size);
+    fmt->green_mask = vesa_channel_mask(mode->green_mask_size);
+    fmt->blue_mask = vesa_channel_mask(mode->blue_mask_size);
+
+    fmt->rgb_mask = 
+        ((uint32_t)fmt->red_mask << fmt->red_shift) |
+        ((uint32_t)fmt->green_mask << fmt->green_shift) |
+        ((uint32_t)fmt->blue_mask << fmt->blue_shift);
+
+    fmt->pack = vesa_pack_generic;
+    fmt->unpack = vesa_unpack_generic;
+
+    /* the usual layouts skip the shifts */
+    if(fmt->rgb_mask == 0xFFFFFF && fmt->red_shift == 16 && 
+        fmt->green_shift == 8 && fmt->blue_shift == 0)
+    {
+        fmt->pack = vesa_pack_rgb888;
+        fmt->unpack = vesa_pack_rgb888;
+    }
+    else
+    if(fmt->rgb_mask == 0xFFFF && fmt->red_shift == 11 && 
+        fmt->green_shift == 5 && fmt->blue_shift == 0)
+    {
+        fmt->pack = vesa_pack_rgb565;
+        fmt->unpack = vesa_unpack_rgb565;
+    }
+
+    fmt->store = vesa_get_store(fmt->bpp);
+    fmt->load = vesa_get_load(fmt->bpp);
+
+    /* the glyphs were packed for the previous mode */
+    for(int i = 0; i < GLYPH_CACHE_SLOTS; i++)
+    {
+        glyph_caches[i].font_ptr = NULL;
+    }
+
+    /* 
+        the back buffer has the size and format of the previous mode, 
+        empty until video_back_buffer_init(): nothing is marked dirty 
+        or presented
+    */
+    video_back.ptr = NULL;
+    video_back.width = 0;
+    video_back.height = 0;
+    video_back_size = 0;
+    video_spans = NULL;
+}
+
 /******************************************************************************/
 
 void
@@ -52,8 +283,39 @@ video_init(void)
 void
 vesa_init(void)
 {
+    /* a second console_init() must not leak the buffers of the first */
+    if(vesa_initialized == 1)
+    {
+        if(vbe_info != NULL)
+        {
+            free(vbe_info);
+        }
+
+        if(vesa_mode_info != NULL)
+        {
+            free(vesa_mode_info);
+        }
+
+        if(vesa_modes != NULL)
+        {
+            free(vesa_modes);
+        }
+    }
+    else
+    {
+        /* the glyph buffers in high memory are kept from then on */
+        memset(glyph_caches, 0, sizeof(glyph_caches));
+        glyph_cache_uses = 0;
+    }
+
+    vesa_initialized = 1;
+
     vbe_info = NULL;
     vesa_mode_info = NULL;
+
+    vesa_modes = NULL;
+    vesa_modes_count = 0;
+    vesa_modes_queried = false;
 }
 
 bool_t
@@ -99,7 +361,7 @@ vesa_get_mode_info(int mode)
 
     if(vesa_mode_info == NULL)
     {
-        vesa_mode_info = (vesa_mode_info_t *)malloc(sizeof(vesa_mode_info_t));
+        vesa_mode_info = (vesa_mode_info_t *)malloc(VESA_MODE_INFO_SIZE);
     }
 
     ctx.ax = 0x4F01;
@@ -133,92 +395,190 @@ vesa_set_mem_window(int window, int position)
     return (ctx.ax == 0x4F);
 }
 
-uint16_t
-vesa_find_mode(int w, int h, int bpp)
+static bool_t
+vesa_mode_usable(vesa_mode_info_t* info)
 {
-    uint16_t last_mode = 0;
+    /* check for color mode and linear frame buffer (LFB) support */
+    if( (info->attributes & 0x19) != 0x19 && 
+        (info->attributes & 0x90) != 0x90 )
+    {
+        return false;
+    }
 
-    if(!vesa_get_info())
+    /* check for packed pixel or direct color mode */
+    if( info->memory_model != 4 &&
+        info->memory_model != 6 )
     {
+        /*
+            00h = Text mode
+            01h = CGA graphics
+            02h = Hercules graphics
+            03h = 4-plane planar
+            04h = Packed pixel
+            05h = Non-chain 4, 256 color
+            06h = Direct Color
+            07h = YUV
+        */
         return false;
     }
 
+    /* check for supported bits per pixel */
+    if( info->bpp != 8 &&
+        info->bpp != 16 && 
+        info->bpp != 32 )
+    {
+        return false;
+    }
+
+    return true;
+}
+
+int
+vesa_enum_modes(void)
+{
+    rmode_ctx_t* ctx;
+    uint8_t* infos;
+
+    int count = 0;
+
+    if(vesa_modes_queried)
+    {
+        return vesa_modes_count;
+    }
+
+    vesa_modes_queried = true;
+
+    if(!vesa_get_info())
+    {
+        return 0;
+    }
+
     uint16_t* modes = (uint16_t *)((
         (vbe_info->video_modes & 0xFFFF0000) >> 12) + 
         (vbe_info->video_modes & 0xFFFF));
 
-    for(int i = 0; modes[i] != 0xFFFF; i++)
+    while(count < VESA_MAX_MODES && modes[count] != 0xFFFF)
     {
-        if(!vesa_get_mode_info(modes[i]))
-        {
-            continue;
-        }
+        count++;
+    }
 
-        /* check for color mode and linear frame buffer (LFB) support */
-        if( (vesa_mode_info->attributes & 0x19) != 0x19 && 
-            (vesa_mode_info->attributes & 0x90) != 0x90 )
-        {
-            continue;
-        }
+    if(count == 0)
+    {
+        return 0;
+    }
 
-        /* check for packed pixel or direct color mode */
-        if( vesa_mode_info->memory_model != 4 &&
-            vesa_mode_info->memory_model != 6 )
-        {
-            /*
-                00h = Text mode
-                01h = CGA graphics
-                02h = Hercules graphics
-                03h = 4-plane planar
-                04h = Packed pixel
-                05h = Non-chain 4, 256 color
-                06h = Direct Color
-                07h = YUV
-            */
-            continue;
-        }
+    /* the table first, the rest is freed below it */
+    vesa_modes = (vesa_mode_t *)malloc(count * sizeof(vesa_mode_t));
+    ctx = (rmode_ctx_t *)malloc(count * sizeof(rmode_ctx_t));
+    infos = (uint8_t *)malloc(count * VESA_MODE_INFO_SIZE);
+
+    for(int i = 0; i < count; i++)
+    {
+        uint32_t info = (uint32_t)(infos + i * VESA_MODE_INFO_SIZE);
+
+        ctx[i].ax = 0x4F01;
+        ctx[i].cx = modes[i];
+        ctx[i].es = (info >> 4);        /* seg */
+        ctx[i].di = (info & 0xF);       /* offs */
+    }
 
-        /* check for supported bits per pixel */
-        if( vesa_mode_info->bpp != 8 &&
-            vesa_mode_info->bpp != 16 && 
-            vesa_mode_info->bpp != 32 )
+    /* all the 4F01h queries in a single trip to real mode */
+    ldr_bios_call_batch(BIOS_SVC_VIDEO, ctx, count);
+
+    for(int i = 0; i < count; i++)
+    {
+        vesa_mode_info_t* info = 
+            (vesa_mode_info_t *)(infos + i * VESA_MODE_INFO_SIZE);
+
+        if(ctx[i].ax != 0x4F || !vesa_mode_usable(info))
         {
             continue;
         }
 
-        last_mode = modes[i];
-        
+        vesa_mode_t* mode = &vesa_modes[vesa_modes_count++];
+
+        mode->mode = modes[i];
+        mode->width = info->x_res;
+        mode->height = info->y_res;
+        mode->pitch = info->bytes_per_scanline;
+        mode->lfb = info->phys_base_ptr;
+        mode->bpp = info->bpp;
+        mode->memory_model = info->memory_model;
+        mode->red_mask_size = info->red_mask_size;
+        mode->red_mask_pos = info->red_mask_pos;
+        mode->green_mask_size = info->green_mask_size;
+        mode->green_mask_pos = info->green_mask_pos;
+        mode->blue_mask_size = info->blue_mask_size;
+        mode->blue_mask_pos = info->blue_mask_pos;
+
 #if 0
 
-        printf(FG_LRED, "%d | %dx%d %dbpp | memory model %d | %d %d\n", 
-            i, 
-            vesa_mode_info->x_res, 
-            vesa_mode_info->y_res, 
-            vesa_mode_info->bpp,
-            vesa_mode_info->memory_model,
-            vesa_mode_info->red_mask_size,
-            vesa_mode_info->red_mask_pos);
+        printf(FG_LRED, "%x | %dx%d %dbpp | memory model %d | %x\n", 
+            mode->mode, 
+            mode->width, 
+            mode->height, 
+            mode->bpp,
+            mode->memory_model,
+            mode->lfb);
 
-        printf(FG_LCYAN, "A:%x, B:%x, WinFunc:%x, PhysBase:%x\n", 
-            vesa_mode_info->win_a_segment, 
-            vesa_mode_info->win_b_segment,
-            vesa_mode_info->win_func_ptr,
-            vesa_mode_info->phys_base_ptr );
+#endif
+    }
 
-        getch();
+    free(infos);
+    free(ctx);
 
-#endif
+    return vesa_modes_count;
+}
+
+vesa_mode_t*
+vesa_get_modes(void)
+{
+    return vesa_modes;
+}
+
+static uint32_t
+vesa_mode_score(vesa_mode_t* mode, int w, int h, int bpp)
+{
+    /* lower is better: the closest resolution, then the closest depth */
+    uint32_t distance = 
+        (mode->width > w ? mode->width - w : w - mode->width) +
+        (mode->height > h ? mode->height - h : h - mode->height);
+
+    /* a deeper mode keeps the colors, a shallower one loses bits */
+    uint32_t depth = (mode->bpp >= bpp) ? 
+        (mode->bpp - bpp) : 64 + (bpp - mode->bpp);
+
+    return (distance << 8) | depth;
+}
 
-        if( vesa_mode_info->x_res == w && 
-            vesa_mode_info->y_res == h &&
-            vesa_mode_info->bpp == bpp )
+static vesa_mode_t*
+vesa_find_best_mode(int w, int h, int bpp)
+{
+    vesa_mode_t* best = NULL;
+    uint32_t best_score = 0;
+
+    vesa_enum_modes();
+
+    for(int i = 0; i < vesa_modes_count; i++)
+    {
+        uint32_t score = vesa_mode_score(&vesa_modes[i], w, h, bpp);
+
+        if(best == NULL || score < best_score)
         {
-            return modes[i];
+            best = &vesa_modes[i];
+            best_score = score;
         }
-
     }
 
-    return last_mode;
+    return best;
+}
+
+uint16_t
+vesa_find_mode(int w, int h, int bpp)
+{
+    vesa_mode_t* mode = vesa_find_best_mode(w, h, bpp);
+
+    return (mode != NULL) ? mode->mode : 0;
 }
 
 bool_t
@@ -226,134 +586,99 @@ vesa_set_mode(int w, int h, int bpp)
 {
     rmode_ctx_t ctx;
 
-    uint16_t mode;
+    vesa_mode_t* mode;
 
-    if((mode = vesa_find_mode(w, h, bpp)) == 0)
+    if((mode = vesa_find_best_mode(w, h, bpp)) == NULL)
         return false;
 
-    /* store the info on the right mode */
-    vesa_get_mode_info(mode);
-
     ctx.ax = 0x4F02;
-    ctx.bx = mode | 0x4000; /* enable linear framebuffer mode */
+    ctx.bx = mode->mode | 0x4000; /* enable linear framebuffer mode */
 
     ldr_bios_call(BIOS_SVC_VIDEO, &ctx);
 
-    return (ctx.ax == 0x4F);
+    if(ctx.ax != 0x4F)
+        return false;
+
+    /* the pixel writers only use the compiled format from now on */
+    vesa_compile_pixel_fmt(mode);
+
+#ifdef _VIDEO_WC
+
+    /* write-combining frame buffer until the chainload (mtrr_restore) */
+    vesa_set_lfb_wc();
+
+#endif
+
+    return true;
+}
+
+bool_t
+vesa_set_lfb_wc(void)
+{
+    uint32_t frame_size = vesa_fmt.pitch * vesa_fmt.height;
+    uint32_t memory_size = (vbe_info != NULL) ? (uint32_t)vbe_info->video_memory << 16 : 0;
+
+    mtrr_restore();
+
+    if(vesa_fmt.lfb == NULL)
+        return false;
+
+    /* 
+        the whole video memory first, a larger range takes fewer MTRRs to 
+        split the UC range of the PCI hole around it
+    */
+    if(memory_size > frame_size && 
+        mtrr_set_wc((uint32_t)vesa_fmt.lfb, memory_size))
+    {
+        return true;
+    }
+
+    return mtrr_set_wc((uint32_t)vesa_fmt.lfb, frame_size);
 }
 
 void
 vesa_get_resolution(uint32_t* w, uint32_t* h)
 {
-    *w = vesa_mode_info->x_res;
-    *h = vesa_mode_info->y_res;
+    *w = vesa_fmt.width;
+    *h = vesa_fmt.height;
+}
+
+vesa_pixel_fmt_t*
+vesa_get_pixel_fmt(void)
+{
+    return &vesa_fmt;
 }
 
 void 
 vesa_set_color(uint8_t* ptr, uint8_t bpp, uint8_t r, uint8_t g, uint8_t b)
 {
-    uint8_t masks[] = 
-    {
-        0x00, 0x01, 0x03, 0x07,
-        0x0F, 0x1F, 0x3F, 0x7F,
-        0xFF
-    };
+    uint32_t pixel = vesa_fmt.pack((uint32_t)r << 16 | (uint32_t)g << 8 | b);
 
-    if(bpp == 32)
-    {
-        *(uint32_t *)ptr = 
-            ((uint32_t)(r & masks[vesa_mode_info->red_mask_size]) << 
-                vesa_mode_info->red_mask_pos) |
-            ((uint32_t)(g & masks[vesa_mode_info->green_mask_size]) << 
-                vesa_mode_info->green_mask_pos) |
-            ((uint32_t)(b & masks[vesa_mode_info->blue_mask_size]) << 
-                vesa_mode_info->blue_mask_pos);
-    }
-    else
-    if(bpp == 16)
-    {
-        *(uint16_t *)ptr = 
-            ((uint16_t)(r & masks[vesa_mode_info->red_mask_size]) << 
-                vesa_mode_info->red_mask_pos) |
-            ((uint16_t)(g & masks[vesa_mode_info->green_mask_size]) << 
-                vesa_mode_info->green_mask_pos) |
-            ((uint16_t)(b & masks[vesa_mode_info->blue_mask_size]) << 
-                vesa_mode_info->blue_mask_pos);
-    }
-    else
-    if(bpp == 8)
-    {
-        *(uint8_t *)ptr = 
-            ((uint8_t)(r & masks[vesa_mode_info->red_mask_size]) << 
-                vesa_mode_info->red_mask_pos) |
-            ((uint8_t)(g & masks[vesa_mode_info->green_mask_size]) << 
-                vesa_mode_info->green_mask_pos) |
-            ((uint8_t)(b & masks[vesa_mode_info->blue_mask_size]) << 
-                vesa_mode_info->blue_mask_pos);
-    }
-    else
-    {
-        /* ??? */
-    }
+    vesa_get_store(bpp)(ptr, pixel);
 }
 
 void 
 vesa_get_color(uint8_t* ptr, uint8_t bpp, uint8_t* r, uint8_t* g, uint8_t* b)
 {
-    uint32_t tmp;
-
-    uint8_t masks[] = 
-    {
-        0x00, 0x01, 0x03, 0x07,
-        0x0F, 0x1F, 0x3F, 0x7F,
-        0xFF
-    };
-
-    if(bpp == 32)
-    {
-        tmp = *(uint32_t *)ptr;
-    }
-    else
-    if(bpp == 16)
-    {
-        tmp = *(uint16_t *)ptr;
-    }
-    else
-    if(bpp == 8)
-    {
-        tmp = *(uint8_t *)ptr;
-    }
-    else
-    {
-        tmp = 0;
-    }
+    uint32_t rgb = vesa_fmt.unpack(vesa_get_load(bpp)(ptr));
 
-    *r = (tmp >> vesa_mode_info->red_mask_pos) & 
-        masks[vesa_mode_info->red_mask_size];
-
-    *g = (tmp >> vesa_mode_info->green_mask_pos) & 
-        masks[vesa_mode_info->green_mask_size];
-
-    *b = (tmp >> vesa_mode_info->blue_mask_pos) & 
-        masks[vesa_mode_info->blue_mask_size];
+    *r = (rgb >> 16) & 0xFF;
+    *g = (rgb >> 8) & 0xFF;
+    *b = rgb & 0xFF;
 }
 
 void 
 vesa_set_pixel(uint32_t x, uint32_t y, uint8_t r, uint8_t g, uint8_t b)
 {
-    uint8_t* lfb = (uint8_t *)vesa_mode_info->phys_base_ptr;
-
     /* check that the linear frame buffer is valid */
-    if(lfb == NULL || lfb == (uint8_t *)(~0))
+    if(vesa_fmt.lfb == NULL)
         return;
 
-    if(x >= vesa_mode_info->x_res || y >= vesa_mode_info->y_res)
+    if(x >= vesa_fmt.width || y >= vesa_fmt.height)
         return;
 
-    lfb += x * (vesa_mode_info->bpp >> 3);
-    lfb += y * vesa_mode_info->bytes_per_scanline;
-
-    vesa_set_color(lfb, vesa_mode_info->bpp, r, g, b);
+    vesa_fmt.store(vesa_fmt.lfb + y * vesa_fmt.pitch + x * vesa_fmt.pixel_size, 
+        vesa_fmt.pack((uint32_t)r << 16 | (uint32_t)g << 8 | b));
 }
 
 uint8_t*
@@ -366,7 +691,8 @@ vesa_get_font_8x8(void)
 
     ldr_bios_call(BIOS_SVC_VIDEO, &ctx);
 
-    return  (uint8_t *)(((uintptr_t)(ctx.es) << 16) | (uintptr_t)(ctx.bp));
+    /* ES:BP, real mode address */
+    return  (uint8_t *)(((uintptr_t)(ctx.es) << 4) + (uintptr_t)(ctx.bp));
 }
 
 uint8_t*
@@ -379,40 +705,121 @@ vesa_get_font_8x16(void)
 
     ldr_bios_call(BIOS_SVC_VIDEO, &ctx);
 
-    return  (uint8_t *)(((uintptr_t)(ctx.es) << 16) | (uintptr_t)(ctx.bp));
+    /* ES:BP, real mode address */
+    return  (uint8_t *)(((uintptr_t)(ctx.es) << 4) + (uintptr_t)(ctx.bp));
 }
 
 /******************************************************************************/
 
-void
-bmp_init(bmp_t* bmp, uint32_t width, uint32_t height, uint8_t bpp, uint8_t* ptr)
-{
-    bmp->width = width;
-    bmp->height = height;
-    bmp->bpp = bpp;
-    bmp->ptr = ptr;
-}
-
-void 
-font_init(font_t* font, uint32_t width, uint32_t height, uint8_t scale, uint8_t* ptr)
+static void
+bmp_convert_row(uint8_t* dst, uint8_t dst_bpp, uint8_t* src, uint8_t src_bpp, 
+    uint32_t count)
 {
-    font->width = width;
-    font->height = height;
-    font->scale = scale;
-    font->ptr = ptr;
-}
+    uint32_t mask = vesa_fmt.rgb_mask;
 
-void
-bmp_get_pixel(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t* rgb)
-{
     uint8_t r;
-    uint8_t g; 
+    uint8_t g;
     uint8_t b;
 
-    uint8_t* tmp = bmp->ptr;
-    uint8_t pixel_size = bmp->bpp >> 3;
-
-    if(x >= bmp->width || y >= bmp->height)
+    /*
+        every bitmap uses the channel layout of the current mode, so only
+        the pixel size differs and a conversion keeps the color bits of the 
+        packed value, as vesa_get_color() and vesa_set_color() would do
+    */
+    if(dst_bpp == src_bpp)
+    {
+        memcpy(dst, src, count * (src_bpp >> 3));
+    }
+    else
+    if(dst_bpp == 32 && src_bpp == 16)
+    {
+        for(uint32_t i = 0; i < count; i++)
+        {
+            ((uint32_t *)dst)[i] = ((uint16_t *)src)[i] & mask;
+        }
+    }
+    else
+    if(dst_bpp == 32 && src_bpp == 8)
+    {
+        for(uint32_t i = 0; i < count; i++)
+        {
+            ((uint32_t *)dst)[i] = src[i] & mask;
+        }
+    }
+    else
+    if(dst_bpp == 16 && src_bpp == 32)
+    {
+        for(uint32_t i = 0; i < count; i++)
+        {
+            ((uint16_t *)dst)[i] = ((uint32_t *)src)[i] & mask;
+        }
+    }
+    else
+    if(dst_bpp == 16 && src_bpp == 8)
+    {
+        for(uint32_t i = 0; i < count; i++)
+        {
+            ((uint16_t *)dst)[i] = src[i] & mask;
+        }
+    }
+    else
+    if(dst_bpp == 8 && src_bpp == 32)
+    {
+        for(uint32_t i = 0; i < count; i++)
+        {
+            dst[i] = ((uint32_t *)src)[i] & mask;
+        }
+    }
+    else
+    if(dst_bpp == 8 && src_bpp == 16)
+    {
+        for(uint32_t i = 0; i < count; i++)
+        {
+            dst[i] = ((uint16_t *)src)[i] & mask;
+        }
+    }
+    else
+    {
+        /* odd pixel sizes, one pixel at a time */
+        for(uint32_t i = 0; i < count; i++)
+        {
+            vesa_get_color(src + i * (src_bpp >> 3), src_bpp, &r, &g, &b);
+            vesa_set_color(dst + i * (dst_bpp >> 3), dst_bpp, r, g, b);
+        }
+    }
+}
+
+/******************************************************************************/
+
+void
+bmp_init(bmp_t* bmp, uint32_t width, uint32_t height, uint8_t bpp, uint8_t* ptr)
+{
+    bmp->width = width;
+    bmp->height = height;
+    bmp->bpp = bpp;
+    bmp->ptr = ptr;
+}
+
+void 
+font_init(font_t* font, uint32_t width, uint32_t height, uint8_t scale, uint8_t* ptr)
+{
+    font->width = width;
+    font->height = height;
+    font->scale = scale;
+    font->ptr = ptr;
+}
+
+void
+bmp_get_pixel(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t* rgb)
+{
+    uint8_t r;
+    uint8_t g; 
+    uint8_t b;
+
+    uint8_t* tmp = bmp->ptr;
+    uint8_t pixel_size = bmp->bpp >> 3;
+
+    if(x >= bmp->width || y >= bmp->height)
         return;
 
     tmp += x * pixel_size;
@@ -423,8 +830,18 @@ bmp_get_pixel(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t* rgb)
     *rgb = (uint32_t)(r << 16 | g << 8 | b);    
 }
 
-void
-bmp_set_pixel(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t rgb)
+static void
+bmp_touch(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    /* only the drawing on the back buffer is tracked */
+    if(bmp == &video_back)
+    {
+        video_mark_dirty(x, y, width, height);
+    }
+}
+
+static void
+bmp_put_pixel(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t rgb)
 {
     uint8_t* tmp = bmp->ptr;
     uint8_t pixel_size = bmp->bpp >> 3;
@@ -439,13 +856,234 @@ bmp_set_pixel(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t rgb)
         (rgb >> 16) & 0xFF, (rgb >> 8) & 0xFF, rgb & 0xFF); 
 }
 
+void
+bmp_set_pixel(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t rgb)
+{
+    bmp_put_pixel(bmp, x, y, rgb);
+    bmp_touch(bmp, x, y, 1, 1);
+}
+
+static void
+glyph_cache_expand(glyph_cache_t* cache, uint8_t* glyph, uint8_t* dst)
+{
+    uint32_t pixel_size = cache->bpp >> 3;
+    uint32_t row_size = cache->font_width * cache->scale * pixel_size;
+
+    uint32_t fg = vesa_fmt.pack(cache->fg);
+    uint32_t bg = vesa_fmt.pack(cache->bg);
+
+    void (*store)(uint8_t*, uint32_t) = vesa_get_store(cache->bpp);
+
+    for(uint32_t sy = 0; sy < cache->font_height; sy++)
+    {
+        uint8_t* tmp = dst;
+
+        for(uint32_t sx = 0; sx < cache->font_width; sx++)
+        {
+            uint32_t pixel = (glyph[sy] & (0x80 >> sx)) ? fg : bg;
+
+            for(uint32_t i = 0; i < cache->scale; i++)
+            {
+                store(tmp, pixel);
+                tmp += pixel_size;
+            }
+        }
+
+        /* the scaled rows are copies of the first one */
+        for(uint32_t i = 1; i < cache->scale; i++)
+        {
+            memcpy(dst + i * row_size, dst, row_size);
+        }
+
+        dst += cache->scale * row_size;
+    }
+}
+
+static uint8_t*
+glyph_cache_get(font_t* font, uint8_t bpp, uint32_t fg, uint32_t bg, uint8_t c)
+{
+    glyph_cache_t* cache = NULL;
+
+    uint32_t glyph_size = font->width * font->scale * 
+        font->height * font->scale * (bpp >> 3);
+
+    if(bpp != 8 && bpp != 16 && bpp != 32)
+        return NULL;
+
+    for(int i = 0; i < GLYPH_CACHE_SLOTS; i++)
+    {
+        glyph_cache_t* tmp = &glyph_caches[i];
+
+        if(tmp->font_ptr == font->ptr && tmp->font_width == font->width &&
+            tmp->font_height == font->height && tmp->scale == font->scale && 
+            tmp->bpp == bpp && tmp->fg == fg && tmp->bg == bg)
+        {
+            cache = tmp;
+            break;
+        }
+
+        /* otherwise replace the least recently used slot */
+        if(cache == NULL || tmp->last_use < cache->last_use)
+        {
+            cache = tmp;
+        }
+    }
+
+    if(cache->font_ptr != font->ptr || cache->font_width != font->width ||
+        cache->font_height != font->height || cache->scale != font->scale || 
+        cache->bpp != bpp || cache->fg != fg || cache->bg != bg)
+    {
+        /* the high memory is never freed, keep the buffer if big enough */
+        if(cache->buffer_size < glyph_size * 256)
+        {
+            cache->buffer = (uint8_t *)mem_high_alloc(glyph_size * 256);
+            cache->buffer_size = (cache->buffer != NULL) ? glyph_size * 256 : 0;
+        }
+
+        if(cache->buffer == NULL)
+        {
+            cache->font_ptr = NULL;
+            return NULL;
+        }
+
+        cache->font_ptr = font->ptr;
+        cache->font_width = font->width;
+        cache->font_height = font->height;
+        cache->scale = font->scale;
+        cache->bpp = bpp;
+        cache->fg = fg;
+        cache->bg = bg;
+        cache->glyph_size = glyph_size;
+
+        memset(cache->loaded, 0, sizeof(cache->loaded));
+    }
+
+    cache->last_use = ++glyph_cache_uses;
+
+    uint8_t* dst = cache->buffer + c * glyph_size;
+
+    /* expand the glyph the first time it is drawn */
+    if((cache->loaded[c >> 3] & (1 << (c & 7))) == 0)
+    {
+        glyph_cache_expand(cache, font->ptr + c * font->height, dst);
+
+        cache->loaded[c >> 3] |= (1 << (c & 7));
+    }
+
+    return dst;
+}
+
+static void
+bmp_draw_glyph_masked(bmp_t* bmp, font_t* font, uint8_t c, uint8_t* dst, 
+    uint32_t width, uint32_t height, uint32_t rgb, uint8_t invert)
+{
+    uint8_t* glyph = font->ptr + c * font->height;
+
+    uint32_t pixel = vesa_fmt.pack(rgb);
+    uint32_t pixel_size = bmp->bpp >> 3;
+    uint32_t pitch = bmp->width * pixel_size;
+
+    void (*store)(uint8_t*, uint32_t) = vesa_get_store(bmp->bpp);
+
+    /* only the pixels of the font bits (or of the cleared ones) */
+    for(uint32_t dy = 0, sy = 0, ry = 0; dy < height; dy++)
+    {
+        uint8_t bits = glyph[sy] ^ invert;
+        uint8_t* tmp = dst;
+
+        for(uint32_t dx = 0, rx = 0, bit = 0x80; dx < width; dx++)
+        {
+            if(bits & bit)
+                store(tmp, pixel);
+
+            tmp += pixel_size;
+
+            if(++rx == font->scale)
+            {
+                rx = 0;
+                bit >>= 1;
+            }
+        }
+
+        dst += pitch;
+
+        if(++ry == font->scale)
+        {
+            ry = 0;
+            sy++;
+        }
+    }
+}
+
+static void
+bmp_draw_glyph(bmp_t* bmp, font_t* font, uint32_t x, uint32_t y, 
+    uint32_t fg, uint32_t bg, uint8_t c)
+{
+    uint32_t glyph_width = font->width * font->scale;
+
+    uint32_t width = glyph_width;
+    uint32_t height = font->height * font->scale;
+
+    uint32_t pixel_size = bmp->bpp >> 3;
+    uint32_t pitch = bmp->width * pixel_size;
+
+    if(x >= bmp->width || y >= bmp->height)
+        return;
+
+    /* clip once per glyph */
+    if(width > bmp->width - x)
+        width = bmp->width - x;
+
+    if(height > bmp->height - y)
+        height = bmp->height - y;
+
+    uint8_t* dst = bmp->ptr + y * pitch + x * pixel_size;
+
+    /* skip the pixels with the alpha channel set */
+    bool_t draw_fg = ((fg & 0xFF000000) == 0);
+    bool_t draw_bg = ((bg & 0xFF000000) == 0);
+
+    if(draw_fg && draw_bg)
+    {
+        uint8_t* src = glyph_cache_get(font, bmp->bpp, fg, bg, c);
+
+        if(src != NULL)
+        {
+            for(uint32_t dy = 0; dy < height; dy++)
+            {
+                memcpy(dst, src, width * pixel_size);
+
+                dst += pitch;
+                src += glyph_width * pixel_size;
+            }
+
+            return;
+        }
+    }
+
+    if(draw_fg)
+        bmp_draw_glyph_masked(bmp, font, c, dst, width, height, fg, 0x00);
+
+    if(draw_bg)
+        bmp_draw_glyph_masked(bmp, font, c, dst, width, height, bg, 0xFF);
+}
+
+void 
+bmp_putc(bmp_t* bmp, font_t* font, uint32_t x, uint32_t y, 
+    uint32_t fg, uint32_t bg, char c)
+{
+    bmp_draw_glyph(bmp, font, x, y, fg, bg, (uint8_t)c);
+
+    bmp_touch(bmp, x, y, font->width * font->scale, 
+        font->height * font->scale);
+}
+
 void 
 bmp_puts(bmp_t* bmp, font_t* font, uint32_t x, uint32_t y, 
     uint32_t fg, uint32_t bg, char* str)
 {
     int len = strlen(str);
 
-    uint32_t color;
     uint32_t tmp_x = x;
     uint32_t tmp_y = y;
 
@@ -469,29 +1107,7 @@ bmp_puts(bmp_t* bmp, font_t* font, uint32_t x, uint32_t y,
         }
         else
         {
-            uint8_t* glyph = font->ptr + ((uint32_t)str[i] * font->height);
-
-            for(int dy = 0; dy < font_height_scaled; dy++)
-            {
-                for(int dx = 0; dx < font_width_scaled; dx++)
-                {
-                    if((glyph[dy / font->scale] & 
-                        (0x80 >> (dx / font->scale))) != 0)
-                    {
-                        color = fg;
-                    }
-                    else
-                    {
-                        color = bg;
-                    }
-
-                    /* skip pixel on alpha channel set */
-                    if((color & 0xFF000000) == 0)
-                    {
-                        bmp_set_pixel(bmp, tmp_x + dx, tmp_y + dy, color);
-                    }
-                }
-            }
+            bmp_putc(bmp, font, tmp_x, tmp_y, fg, bg, str[i]);
 
             tmp_x += font_width_scaled;
         }
@@ -501,101 +1117,632 @@ bmp_puts(bmp_t* bmp, font_t* font, uint32_t x, uint32_t y,
 void
 bmp_bitblt(bmp_t* src, bmp_t* dst, uint32_t dst_x, uint32_t dst_y)
 {
-    uint32_t rgb;
+    uint32_t width = src->width;
+    uint32_t height = src->height;
+
+    uint32_t src_pitch = src->width * (src->bpp >> 3);
+    uint32_t dst_pitch = dst->width * (dst->bpp >> 3);
 
-    /* bit block transfer */
-    for(int y = 0; y < src->height; y++)
+    if(dst_x >= dst->width || dst_y >= dst->height)
+        return;
+
+    /* clip once, then transfer the block a row at a time */
+    if(width > dst->width - dst_x)
+        width = dst->width - dst_x;
+
+    if(height > dst->height - dst_y)
+        height = dst->height - dst_y;
+
+    uint8_t* src_row = src->ptr;
+    uint8_t* dst_row = dst->ptr + dst_y * dst_pitch + dst_x * (dst->bpp >> 3);
+
+    for(uint32_t y = 0; y < height; y++)
     {
-        for(int x = 0; x < src->width; x++)
-        {
-            bmp_get_pixel(src, x, y, &rgb);
-            bmp_set_pixel(dst, dst_x + x, dst_y + y, rgb);
-        }
+        bmp_convert_row(dst_row, dst->bpp, src_row, src->bpp, width);
+
+        src_row += src_pitch;
+        dst_row += dst_pitch;
     }
+
+    bmp_touch(dst, dst_x, dst_y, width, height);
 }
 
-void 
+static void
+bmp_fill_span(uint8_t* dst, uint8_t bpp, uint32_t pixel, uint32_t count)
+{
+    void (*store)(uint8_t*, uint32_t) = vesa_get_store(bpp);
+
+    uint8_t pixel_size = bpp >> 3;
+    uint32_t pattern = pixel;
+
+    /* the pixel replicated over a dword, as store() would truncate it */
+    if(bpp == 8)
+        pattern = (pixel & 0xFF) * 0x01010101;
+    else
+    if(bpp == 16)
+        pattern = (pixel & 0xFFFF) * 0x00010001;
+    else
+    if(bpp != 32)
+        return; /* no pixel writer for the other sizes */
+
+    /* the pixels up to a dword boundary */
+    while(count != 0 && ((uint32_t)dst & 3))
+    {
+        store(dst, pixel);
+        dst += pixel_size;
+        count--;
+    }
+
+    uint32_t dwords = (count * pixel_size) >> 2;
+
+    if(dwords != 0)
+    {
+        memset32(dst, pattern, dwords);
+
+        dst += dwords << 2;
+        count -= (dwords << 2) / pixel_size;
+    }
+
+    /* 8 and 16 bpp, the last pixels of a dword */
+    while(count != 0)
+    {
+        store(dst, pixel);
+        dst += pixel_size;
+        count--;
+    }
+}
+
+void
 bmp_rect(bmp_t* bmp, uint32_t x, uint32_t y, uint32_t width, 
     uint32_t height, uint32_t rgb)
 {
-   for(int i = y; i < y + height; i++) 
-   {
-        for(int j = x; j < x + width; j++)
+    uint32_t pixel = vesa_fmt.pack(rgb);
+    uint32_t pitch = bmp->width * (bmp->bpp >> 3);
+
+    if(x >= bmp->width || y >= bmp->height)
+        return;
+
+    /* clip once, then fill the rectangle a span at a time */
+    if(width > bmp->width - x)
+        width = bmp->width - x;
+
+    if(height > bmp->height - y)
+        height = bmp->height - y;
+
+    uint8_t* row = bmp->ptr + y * pitch + x * (bmp->bpp >> 3);
+
+    /* full rows are contiguous, a single span */
+    if(width == bmp->width)
+    {
+        bmp_fill_span(row, bmp->bpp, pixel, width * height);
+    }
+    else
+    {
+        for(uint32_t i = 0; i < height; i++)
         {
-            bmp_set_pixel(bmp, j, i, rgb);
+            bmp_fill_span(row, bmp->bpp, pixel, width);
+            row += pitch;
         }
     }
+
+    bmp_touch(bmp, x, y, width, height);
 }
 
 void
 bmp_from_ppm(bmp_t* bmp, uint8_t* ppm)
 {
-    char* end;
-    int tmp = 0;
+    img_decoder_t dec;
+
+    img_decoder_init(&dec, bmp, 0, 0);
+
+    /* the bitmap takes the size of the image */
+    dec.fit = true;
+
+    /* the file is all in memory, the decoder stops after the last row */
+    img_decoder_feed(&dec, ppm, 0xFFFFFFFF);
+    img_decoder_end(&dec);
+}
+
+/******************************************************************************/
+
+void
+img_decoder_init(img_decoder_t* dec, bmp_t* dst, uint32_t x, uint32_t y)
+{
+    memset(dec, 0, sizeof(img_decoder_t));
+
+    dec->dst = dst;
+    dec->dst_x = x;
+    dec->dst_y = y;
+    dec->state = IMG_STATE_MAGIC;
+}
+
+static uint32_t
+img_read_le(uint8_t* ptr, int size)
+{
+    uint32_t value = 0;
+
+    while(size-- > 0)
+    {
+        value = (value << 8) | ptr[size];
+    }
+
+    return value;
+}
+
+static bool_t
+img_begin_pixels(img_decoder_t* dec)
+{
+    if(dec->width == 0 || dec->height == 0)
+        return false;
+
+    if(dec->fit)
+    {
+        dec->dst->width = dec->width;
+        dec->dst->height = dec->height;
+    }
+
+    dec->row_size = dec->width * dec->pixel_size;
+
+    /* BMP rows are padded to 4 bytes */
+    if(dec->format == IMG_FORMAT_BMP)
+        dec->row_size = (dec->row_size + 3) & ~3;
+
+    /* only for the rows split across two chunks */
+    if((dec->row_buffer = (uint8_t *)malloc(dec->row_size)) == NULL)
+        return false;
+
+    dec->fill = 0;
+    dec->row = 0;
+    dec->state = (dec->skip != 0) ? IMG_STATE_SKIP : IMG_STATE_PIXELS;
+
+    return true;
+}
+
+static bool_t
+img_parse_ppm(img_decoder_t* dec, uint8_t c)
+{
+    /* comments run to the end of the line */
+    if(dec->comment)
+    {
+        if(c == '\n' || c == '\r')
+            dec->comment = false;
+
+        return true;
+    }
+
+    if(c >= '0' && c <= '9')
+    {
+        dec->value = dec->value * 10 + (c - '0');
+        dec->digits = true;
+
+        return (dec->value <= 0xFFFF);
+    }
+
+    if(c != '#' && c != ' ' && c != '\t' && c != '\n' && c != '\r')
+        return false;
+
+    if(dec->digits)
+    {
+        if(dec->field == 0)
+            dec->width = dec->value;
+        else
+        if(dec->field == 1)
+            dec->height = dec->value;
+        else
+        {
+            /* a single whitespace after the maximum value, then the pixels */
+            if(c == '#' || dec->value == 0)
+                return false;
+
+            dec->maxval = dec->value;
+            dec->pixel_size = (dec->maxval > 0xFF) ? 6 : 3;
+            dec->scale = ((0xFF << 16) + dec->maxval / 2) / dec->maxval;
+
+            return img_begin_pixels(dec);
+        }
+
+        dec->field++;
+        dec->value = 0;
+        dec->digits = false;
+    }
+
+    if(c == '#')
+        dec->comment = true;
+
+    return true;
+}
+
+static bool_t
+img_parse_bmp(img_decoder_t* dec)
+{
+    uint8_t* header = dec->header;
+
+    uint32_t offset = img_read_le(header + 10, 4);
+    uint32_t info_size = img_read_le(header + 14, 4);
+    int32_t width = (int32_t)img_read_le(header + 18, 4);
+    int32_t height = (int32_t)img_read_le(header + 22, 4);
+    uint32_t bits = img_read_le(header + 28, 2);
+    uint32_t compression = img_read_le(header + 30, 4);
+
+    /* uncompressed (BI_RGB) 24 or 32 bits per pixel, no palette */
+    if(info_size < 40 || (bits != 24 && bits != 32) || compression != 0 ||
+        width <= 0 || height == 0 || offset < IMG_BMP_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    /* the rows are stored bottom-up unless the height is negative */
+    dec->bottom_up = (height > 0);
+    dec->width = width;
+    dec->height = (height > 0) ? height : -height;
+    dec->pixel_size = bits >> 3;
+    dec->skip = offset - IMG_BMP_HEADER_SIZE;
+
+    return img_begin_pixels(dec);
+}
+
+static inline uint32_t
+img_sample(img_decoder_t* dec, const uint8_t* src)
+{
+    uint32_t value = (dec->pixel_size == 6) ? 
+        ((uint32_t)src[0] << 8 | src[1]) : src[0];
+
+    value = (value * dec->scale + 0x8000) >> 16;
+
+    return (value > 0xFF) ? 0xFF : value;
+}
+
+static inline uint32_t
+img_pixel(img_decoder_t* dec, const uint8_t* src)
+{
+    uint8_t size = dec->pixel_size;
 
-    if(ppm[0] != 'P' || ppm[1] != '6')
+    if(dec->format == IMG_FORMAT_BMP)
+    {
+        return (uint32_t)src[2] << 16 | (uint32_t)src[1] << 8 | src[0];
+    }
+
+    if(dec->maxval == 0xFF)
+    {
+        return (uint32_t)src[0] << 16 | (uint32_t)src[1] << 8 | src[2];
+    }
+
+    return 
+        img_sample(dec, src) << 16 | 
+        img_sample(dec, src + (size / 3)) << 8 | 
+        img_sample(dec, src + 2 * (size / 3));
+}
+
+static void
+img_convert_row(img_decoder_t* dec, const uint8_t* src)
+{
+    bmp_t* dst = dec->dst;
+
+    uint32_t count = dec->width;
+    uint32_t y = dec->bottom_up ? (dec->height - 1 - dec->row) : dec->row;
+
+    uint8_t pixel_size = dst->bpp >> 3;
+
+    if(dec->dst_x >= dst->width || y >= dst->height - dec->dst_y || 
+        dec->dst_y >= dst->height)
+    {
         return;
+    }
+
+    if(count > dst->width - dec->dst_x)
+        count = dst->width - dec->dst_x;
 
-    /* skip the magic number */
-    ppm += 3;
+    uint8_t* ptr = dst->ptr + 
+        ((dec->dst_y + y) * dst->width + dec->dst_x) * pixel_size;
 
-    /* consume all the comments */
-    while(true)
+    /* the source pixels go straight to the format of the bitmap */
+    if(dst->bpp == 32 && vesa_fmt.pack == vesa_pack_rgb888)
     {
-        if(*ppm == '#')
-            tmp = true;
-        
-        if(tmp)
+        for(uint32_t i = 0; i < count; i++)
+        {
+            ((uint32_t *)ptr)[i] = img_pixel(dec, src);
+            src += dec->pixel_size;
+        }
+    }
+    else
+    {
+        void (*store)(uint8_t*, uint32_t) = vesa_get_store(dst->bpp);
+
+        for(uint32_t i = 0; i < count; i++)
+        {
+            store(ptr, vesa_fmt.pack(img_pixel(dec, src)));
+            src += dec->pixel_size;
+            ptr += pixel_size;
+        }
+    }
+}
+
+uint32_t
+img_decoder_feed(img_decoder_t* dec, const uint8_t* data, uint32_t count)
+{
+    uint32_t taken = 0;
+
+    while(taken < count)
+    {
+        uint32_t size = count - taken;
+
+        if(dec->state == IMG_STATE_PIXELS)
+        {
+            /* whole rows are converted in place, from the chunk */
+            if(dec->fill == 0 && size >= dec->row_size)
+            {
+                img_convert_row(dec, data + taken);
+                taken += dec->row_size;
+            }
+            else
+            {
+                if(size > dec->row_size - dec->fill)
+                    size = dec->row_size - dec->fill;
+
+                memcpy(dec->row_buffer + dec->fill, (uint8_t *)data + taken, size);
+
+                dec->fill += size;
+                taken += size;
+
+                if(dec->fill < dec->row_size)
+                    break;
+
+                img_convert_row(dec, dec->row_buffer);
+                dec->fill = 0;
+            }
+
+            if(++dec->row == dec->height)
+                dec->state = IMG_STATE_DONE;
+        }
+        else
+        if(dec->state == IMG_STATE_SKIP)
+        {
+            if(size > dec->skip)
+                size = dec->skip;
+
+            dec->skip -= size;
+            taken += size;
+
+            if(dec->skip == 0)
+                dec->state = IMG_STATE_PIXELS;
+        }
+        else
+        if(dec->state == IMG_STATE_MAGIC)
         {
-            if(*ppm == '\n' || *ppm == '\r')
-                tmp = false;
+            dec->header[dec->fill++] = data[taken++];
 
-            ppm++;
+            if(dec->fill < 2)
+                continue;
+
+            if(dec->header[0] == 'P' && dec->header[1] == '6')
+            {
+                dec->format = IMG_FORMAT_PPM;
+                dec->state = IMG_STATE_PPM;
+            }
+            else
+            if(dec->header[0] == 'B' && dec->header[1] == 'M')
+            {
+                dec->format = IMG_FORMAT_BMP;
+                dec->state = IMG_STATE_BMP;
+            }
+            else
+            {
+                dec->state = IMG_STATE_ERROR;
+            }
         }
         else
+        if(dec->state == IMG_STATE_PPM)
         {
+            if(!img_parse_ppm(dec, data[taken++]))
+                dec->state = IMG_STATE_ERROR;
+        }
+        else
+        if(dec->state == IMG_STATE_BMP)
+        {
+            if(size > IMG_BMP_HEADER_SIZE - dec->fill)
+                size = IMG_BMP_HEADER_SIZE - dec->fill;
+
+            memcpy(dec->header + dec->fill, (uint8_t *)data + taken, size);
+
+            dec->fill += size;
+            taken += size;
+
+            if(dec->fill == IMG_BMP_HEADER_SIZE && !img_parse_bmp(dec))
+                dec->state = IMG_STATE_ERROR;
+        }
+        else
+        {
+            /* done, or not an image we know */
             break;
         }
-    } 
+    }
 
-    bmp->width = atoi((char *)ppm, &end); 
-    bmp->height = atoi(end + 1, &end); 
+    return taken;
+}
 
-    /* maximum value for each color (1 or 2 bytes) */
-    tmp = atoi(end + 1, &end);
-    ppm = (uint8_t *)end + 1;
+bool_t
+img_decoder_end(img_decoder_t* dec)
+{
+    if(dec->row_buffer != NULL)
+    {
+        free(dec->row_buffer);
+        dec->row_buffer = NULL;
+    }
 
-    /* translate the rgb triplets to the bmp format */
-    for(int y = 0; y < bmp->height; y++)
+    if(dec->row != 0)
     {
-        for(int x = 0; x < bmp->width; x++)
-        {
-            bmp_set_pixel(bmp, x, y, 
-                (uint32_t)ppm[0] << 16 | 
-                (uint32_t)ppm[1] << 8 | 
-                (uint32_t)ppm[2]);
+        bmp_touch(dec->dst, dec->dst_x, dec->dst_y, dec->width, dec->height);
+    }
+
+    return (dec->state == IMG_STATE_DONE);
+}
+
+static UINT
+img_decoder_stream(void* ctx, const BYTE* data, UINT count)
+{
+    return img_decoder_feed((img_decoder_t *)ctx, data, count);
+}
+
+bool_t
+bmp_load_image(bmp_t* bmp, uint32_t x, uint32_t y, char* path)
+{
+    FIL file;
+    UINT bytes_read;
+
+    img_decoder_t dec;
+
+    if(pf_open(&file, path) != FR_OK)
+        return false;
+
+    img_decoder_init(&dec, bmp, x, y);
+
+    /* one pass over the file, the sectors are handed over in place */
+    pf_read_stream(&file, img_decoder_stream, &dec, file.fsize, &bytes_read);
+
+    return img_decoder_end(&dec);
+}
 
-            ppm += 3;
+void
+bmp_to_framebuffer(bmp_t* bmp)
+{
+    uint8_t* lfb = vesa_fmt.lfb;
+    uint8_t* row = bmp->ptr;
+
+    uint32_t width = bmp->width;
+    uint32_t height = bmp->height;
+
+    uint32_t pitch = bmp->width * (bmp->bpp >> 3);
+
+    /* check that the linear frame buffer is valid */
+    if(lfb == NULL)
+        return;
+
+    if(width > vesa_fmt.width)
+        width = vesa_fmt.width;
+
+    if(height > vesa_fmt.height)
+        height = vesa_fmt.height;
+
+    /* one row copy (or conversion) per scanline */
+    for(uint32_t y = 0; y < height; y++)
+    {
+        bmp_convert_row(lfb, vesa_fmt.bpp, row, bmp->bpp, width);
+
+        row += pitch;
+        lfb += vesa_fmt.pitch;
+    }
+}
+
+/******************************************************************************/
+
+bmp_t*
+video_back_buffer_init(void)
+{
+    uint32_t size = vesa_fmt.width * vesa_fmt.height * vesa_fmt.pixel_size;
+
+    /* the back buffer has the format of the mode, set it first */
+    if(vesa_fmt.lfb == NULL || size == 0)
+        return NULL;
+
+    /* allocated once per mode, a second call reuses the buffers */
+    if(size > video_back_size)
+    {
+        video_back.ptr = (uint8_t *)mem_high_alloc(size);
+        video_spans = (video_span_t *)mem_high_alloc(
+            vesa_fmt.height * sizeof(video_span_t));
+
+        if(video_back.ptr == NULL || video_spans == NULL)
+        {
+            video_back.ptr = NULL;
+            video_back_size = 0;
+            return NULL;
         }
+
+        video_back_size = size;
     }
+
+    bmp_init(&video_back, vesa_fmt.width, vesa_fmt.height, vesa_fmt.bpp, 
+        video_back.ptr);
+
+    memset(video_back.ptr, 0, size);
+    memset(video_spans, 0, vesa_fmt.height * sizeof(video_span_t));
+
+    video_dirty_top = vesa_fmt.height;
+    video_dirty_bottom = 0;
+
+    /* the frame buffer content is unknown, the first present is complete */
+    video_mark_dirty(0, 0, video_back.width, video_back.height);
+
+    return &video_back;
 }
 
 void
-bmp_to_framebuffer(bmp_t* bmp)
+video_mark_dirty(uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
-    uint32_t rgb;
+    if(x >= video_back.width || y >= video_back.height)
+        return;
+
+    if(width > video_back.width - x)
+        width = video_back.width - x;
+
+    if(height > video_back.height - y)
+        height = video_back.height - y;
+
+    if(width == 0 || height == 0)
+        return;
 
-    /* bit block transfer */
-    for(int y = 0; y < bmp->height; y++)
+    /* union with the dirty span of each row */
+    for(uint32_t i = y; i < y + height; i++)
     {
-        for(int x = 0; x < bmp->width; x++)
+        video_span_t* span = &video_spans[i];
+
+        if(span->x1 == 0)
         {
-            bmp_get_pixel(bmp, x, y, &rgb);
+            span->x0 = x;
+            span->x1 = x + width;
+        }
+        else
+        {
+            if(span->x0 > x)
+                span->x0 = x;
 
-            /* not really efficient... */
-            vesa_set_pixel(x, y, (rgb >> 16) & 0xFF, 
-                (rgb >> 8) & 0xFF, rgb & 0xFF);
+            if(span->x1 < x + width)
+                span->x1 = x + width;
         }
     }
+
+    if(video_dirty_top > y)
+        video_dirty_top = y;
+
+    if(video_dirty_bottom < y + height)
+        video_dirty_bottom = y + height;
 }
 
+void
+video_present(void)
+{
+    uint32_t pixel_size = vesa_fmt.pixel_size;
+    uint32_t pitch = video_back.width * pixel_size;
+
+    if(video_back.ptr == NULL)
+        return;
+
+    /* same format on both sides, one copy per dirty span */
+    for(uint32_t y = video_dirty_top; y < video_dirty_bottom; y++)
+    {
+        video_span_t* span = &video_spans[y];
+
+        if(span->x1 == 0)
+            continue;
+
+        memcpy(vesa_fmt.lfb + y * vesa_fmt.pitch + span->x0 * pixel_size, 
+            video_back.ptr + y * pitch + span->x0 * pixel_size, 
+            (span->x1 - span->x0) * pixel_size);
+
+        span->x0 = 0;
+        span->x1 = 0;
+    }
+
+    video_dirty_top = video_back.height;
+    video_dirty_bottom = 0;
+}